@@ -0,0 +1,116 @@
+// POLEPP - Portable C++ library to access OLE Storage 
+// Copyright (C) 2004-2006 Jorge Lodos Vigil
+// Copyright (C) 2004 Israel Fernandez Cabrera
+
+//   Redistribution and use in source and binary forms, with or without 
+//   modification, are permitted provided that the following conditions 
+//   are met:
+//   * Redistributions of source code must retain the above copyright notice, 
+//     this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright notice, 
+//     this list of conditions and the following disclaimer in the documentation 
+//     and/or other materials provided with the distribution.
+//   * Neither the name of the authors nor the names of its contributors may be 
+//     used to endorse or promote products derived from this software without 
+//     specific prior written permission.
+//
+//   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+//   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+//   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+//   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+//   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+//   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+//   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+//   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+//   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+//   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+//   THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+#ifndef _OLE_BUILDER_
+#define _OLE_BUILDER_
+
+#include "pole/pole.h"
+#include "storage.hpp"
+
+namespace ole
+{
+	// The document_builder class creates new compound documents. The storages 
+	// and streams are declared first, with the size of each stream and the 
+	// source of its content. Then save() writes the whole document in one
+	// sequential pass, every stream being stored contiguously.
+	// Paths are always absolute, intermediate storages are created as needed.
+	// This class is not thread safe.
+	template<typename _ = void>
+	class basic_document_builder
+	{
+	public:
+		// Called until the stream content is complete, must copy at most len bytes
+		// to buffer and return the number of bytes copied.
+		typedef POLE::BuilderSource source;
+
+		// Receives the document bytes in order, must return false to abort.
+		typedef POLE::BuilderSink sink;
+
+	// Construction
+	public:
+		basic_document_builder() {}
+
+	// Attributes
+	public:
+		// Returns true if the last operation succeeded. A declaration that
+		// fails, for instance for a name longer than 31 characters or a stream
+		// declared twice, adds nothing and the document may still be saved.
+		bool good() const { return m_builder.result() == POLE::Builder::Ok; }
+
+		// Returns the size of the document as it will be saved. This is known 
+		// before writing, for instance to announce the length of a transfer.
+		std::streamoff size() { return m_builder.plan().size(); }
+
+	// Operations
+	public:
+		// Documents are written in version 4 (4096 bytes sectors) unless 3 is 
+		// requested here for old readers.
+		void set_version(unsigned major) { m_builder.set_version(major); }
+
+		// Declare a new storage.
+		bool create_directory(const std::string& directory) { return m_builder.add_directory(directory); }
+
+		// Declare a new stream whose content is provided by src.
+		bool create_file(const std::string& filename, POLE::ULONG64 size, const source& src) { return m_builder.add_stream(filename, size, src); }
+
+		// Declare a new stream whose content is in memory. The data must remain 
+		// valid until save is called.
+		bool create_file(const std::string& filename, const char* data, POLE::ULONG64 size) { return m_builder.add_stream(filename, (const unsigned char*)data, size); }
+
+		// Declare a new stream whose content is the file disk_file.
+		bool import_file(const std::string& filename, const std::string& disk_file) { return m_builder.add_file(filename, disk_file.c_str()); }
+
+		// Declare a copy of the stream or storage from of doc as to, with 
+		// everything below it. The content is copied block run by block run
+		// when saving, doc must remain open until then. Storages of many
+		// documents may be merged this way.
+		bool import(const compound_document& doc, const std::string& from, const std::string& to) { return doc.m_storage && doc.m_storage->transplant(m_builder, from, to); }
+
+		// Writes the document. Sources are consumed, so this may be called once.
+		// The document is written sequentially, the output is never sought so
+		// it may be a pipe, a socket or a compressor.
+		bool save(const std::string& filename) { return m_builder.save(filename.c_str()); }
+		bool save(std::ostream& os) { return m_builder.save(os); }
+		bool save(const sink& snk) { return m_builder.save(snk); }
+
+		// Forget all declared entries so the object may be used for a new document.
+		void clear() { m_builder.clear(); }
+
+	// Implementation
+	private:
+		POLE::Builder m_builder;
+
+		basic_document_builder(const basic_document_builder<_>&); // no copy construction
+		basic_document_builder<_>& operator=(const basic_document_builder<_>&); // no assignment operator
+	};
+
+	typedef basic_document_builder<> document_builder;
+}
+
+#endif // _OLE_BUILDER_
@@ -0,0 +1,92 @@
+// POLEPP - Portable C++ library to access OLE Storage 
+// Copyright (C) 2004-2006 Jorge Lodos Vigil
+// Copyright (C) 2004 Israel Fernandez Cabrera
+
+//   Redistribution and use in source and binary forms, with or without 
+//   modification, are permitted provided that the following conditions 
+//   are met:
+//   * Redistributions of source code must retain the above copyright notice, 
+//     this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright notice, 
+//     this list of conditions and the following disclaimer in the documentation 
+//     and/or other materials provided with the distribution.
+//   * Neither the name of the authors nor the names of its contributors may be 
+//     used to endorse or promote products derived from this software without 
+//     specific prior written permission.
+//
+//   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+//   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+//   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+//   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+//   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+//   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+//   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+//   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+//   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+//   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+//   THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+#ifndef _OLE_DOCUMENT_CACHE_
+#define _OLE_DOCUMENT_CACHE_
+
+#if !defined(_WIN32)
+
+#include <boost/shared_ptr.hpp>
+#include "storage.hpp"
+
+namespace ole
+{
+	// The document_cache class opens documents sharing their parsed 
+	// directory and allocation tables with every other open of the same 
+	// unchanged file, so opening a document again costs no reads. Files are 
+	// known by device and inode and the cached data is dropped when their 
+	// size or modification time change. By default the cache of the process
+	// is used, its memory is limited by a budget and, since each cached 
+	// document keeps its file open, the number of documents by max_files.
+	// The documents are read only and share their directory, so their current
+	// directory is always the root and can not be changed. This class is 
+	// thread safe.
+	template<typename _ = void>
+	class basic_document_cache
+	{
+	public:
+		typedef boost::shared_ptr<compound_document> document_ptr;
+
+	// Construction/destruction
+	public:
+		basic_document_cache(): m_cache(POLE::MetadataCache::global()) {}
+		basic_document_cache(POLE::MetadataCache& cache): m_cache(cache) {}
+
+	// Attributes
+	public:
+		POLE::ULONG64 budget() const { return m_cache.budget(); }
+		POLE::ULONG64 memory() const { return m_cache.memory(); }
+		size_t max_files() const { return m_cache.max_files(); }
+
+	// Operations
+	public:
+		// Returns a read only document, NULL if filename is not a valid document.
+		document_ptr open(const std::string& filename) const 
+		{ 
+			POLE::MetadataCache::Version version = m_cache.open(filename.c_str()); 
+			return version ? document_ptr(new compound_document(version)) : document_ptr(); 
+		}
+		void set_budget(POLE::ULONG64 budget) { m_cache.set_budget(budget); }
+		void set_max_files(size_t max_files) { m_cache.set_max_files(max_files); }
+		void clear() { m_cache.clear(); }
+
+	// Implementation
+	private:
+		POLE::MetadataCache& m_cache;
+
+		basic_document_cache(const basic_document_cache<_>&); // no copy construction
+		basic_document_cache<_>& operator=(const basic_document_cache<_>&); // no assignment operator
+	};
+
+	typedef basic_document_cache<> document_cache;
+}
+
+#endif // !_WIN32
+
+#endif // _OLE_DOCUMENT_CACHE_
@@ -0,0 +1,258 @@
+// POLEPP - Portable C++ library to access OLE Storage 
+// Copyright (C) 2004-2006 Jorge Lodos Vigil
+// Copyright (C) 2004 Israel Fernandez Cabrera
+
+//   Redistribution and use in source and binary forms, with or without 
+//   modification, are permitted provided that the following conditions 
+//   are met:
+//   * Redistributions of source code must retain the above copyright notice, 
+//     this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright notice, 
+//     this list of conditions and the following disclaimer in the documentation 
+//     and/or other materials provided with the distribution.
+//   * Neither the name of the authors nor the names of its contributors may be 
+//     used to endorse or promote products derived from this software without 
+//     specific prior written permission.
+//
+//   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+//   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+//   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+//   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+//   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+//   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+//   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+//   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+//   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+//   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+//   THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+#ifndef _OLE_EXTRACTOR_
+#define _OLE_EXTRACTOR_
+
+#include <fstream>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/filesystem/exception.hpp>
+#include <boost/filesystem/operations.hpp>
+#include "storage.hpp"
+
+namespace ole
+{
+	// The extractor class writes a compound document to the file system, 
+	// storages become directories and streams become files. The directories
+	// are created first, then the streams are read in chunks on a pool of 
+	// threads and every chunk is written as soon as it is read. Chunks of the
+	// same stream are read in parallel, and the memory held by the chunks in
+	// flight is bounded, so streams are never loaded whole.
+	// On POSIX systems the chunks are copied with stream::copy_to, by the
+	// kernel when the document is read with POLE::PosixBackend.
+	// Nobody may write to the document during the extraction.
+	template<typename _ = void>
+	class basic_extractor
+	{
+	// Construction/destruction
+	public:
+		// threads is the number of workers, 0 for one per processor. memory is
+		// the most chunk data in flight, at least one chunk, it bounds all the
+		// buffers of the extraction.
+		basic_extractor(compound_document& doc, unsigned threads = 0, std::streamsize chunk_size = 1 << 20, std::streamsize memory = 64 << 20)
+			: m_doc(doc), m_pool(threads), m_chunk_size(chunk_size < 1 ? 1 : chunk_size), 
+			  m_memory(memory < m_chunk_size ? m_chunk_size : memory), m_available(0), m_failed(false) {}
+
+	// Operations
+	public:
+		// Extracts the whole document under folder, which is created if needed.
+		// Returns false if a directory or file could not be created, or a stream
+		// could not be read or written.
+		bool extract(const boost::filesystem::path& folder);
+
+	// Implementation
+	private:
+		// A file being written, closed after its last chunk
+		struct output
+		{
+			boost::filesystem::path name;
+			std::auto_ptr<ole::stream> source;
+#if !defined(_WIN32)
+			int fd;         // opened by the first chunk
+#else
+			std::ofstream file;
+#endif
+			boost::mutex mutex;
+			size_t pending; // chunks not written yet
+		};
+
+		boost::filesystem::path local_path(const path& p, const boost::filesystem::path& folder) const;
+		void extract_chunk(output* out, std::streamoff pos, std::streamsize len);
+		void fail() { boost::mutex::scoped_lock lock(m_mutex); m_failed = true; }
+
+		compound_document& m_doc;
+		POLE::WorkPool m_pool;
+		std::streamsize m_chunk_size;
+		std::streamsize m_memory;
+		std::streamsize m_available; // memory for new chunks
+		bool m_failed;
+		boost::mutex m_mutex;
+		boost::condition_variable m_released;
+
+		basic_extractor(const basic_extractor<_>&); // no copy construction
+		basic_extractor<_>& operator=(const basic_extractor<_>&); // no assignment operator
+	};
+
+	typedef basic_extractor<> extractor;
+
+	////////////////////////////////////////////////////////////////////////////////////////////
+	// basic_extractor implementation
+	////////////////////////////////////////////////////////////////////////////////////////////
+
+	template <typename _>
+	bool basic_extractor<_>::extract(const boost::filesystem::path& folder)
+	{
+		m_failed = false;
+		m_available = m_memory;
+		std::vector<path> entries;
+		m_doc.entries_in_document(entries);
+
+		// the directory skeleton first
+		std::vector<boost::shared_ptr<output> > outputs;
+		try
+		{
+			boost::filesystem::create_directories(folder);
+			for (size_t i = 0; i < entries.size(); ++i)
+				if (entries[i].is_directory() && !entries[i].is_root())
+					boost::filesystem::create_directories(local_path(entries[i], folder));
+		}
+		catch (const boost::filesystem::filesystem_error&)
+		{
+			return false;
+		}
+
+		// then one job per chunk of every stream
+		for (size_t i = 0; i < entries.size(); ++i)
+		{
+			if (!entries[i].is_file())
+				continue;
+			boost::shared_ptr<output> out(new output);
+			out->name = local_path(entries[i], folder);
+			out->source = m_doc.stream(entries[i]);
+#if !defined(_WIN32)
+			out->fd = -1;
+#endif
+			if (!out->source.get())
+			{
+				fail();
+				break;
+			}
+			std::streamsize size = out->source->size();
+			out->pending = (size_t)((size + m_chunk_size - 1) / m_chunk_size);
+			if (!size)
+			{
+				std::ofstream file(out->name.string().c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+				if (file.fail())
+					fail();
+				continue;
+			}
+			outputs.push_back(out);
+			for (std::streamoff pos = 0; pos < size; pos += m_chunk_size)
+				m_pool.submit(boost::bind(&basic_extractor<_>::extract_chunk, this, out.get(), pos, 
+					(size - pos < m_chunk_size) ? (std::streamsize)(size - pos) : m_chunk_size));
+		}
+		m_pool.wait();
+		return !m_failed;
+	}
+
+	template <typename _>
+	boost::filesystem::path basic_extractor<_>::local_path(const path& p, const boost::filesystem::path& folder) const
+	{
+		boost::filesystem::path result = folder;
+		path::iterator it;
+		for (it = p.begin(m_doc); it != p.end(); ++it)
+		{
+			if (*it == "/")
+				continue;
+			// Make sure the name is valid
+			std::string name = *it;
+			if (!name.empty() && name[0] < ' ')
+				name.erase(0, 1);
+			result /= name;
+		}
+		return result;
+	}
+
+	template <typename _>
+	void basic_extractor<_>::extract_chunk(output* out, std::streamoff pos, std::streamsize len)
+	{
+		// wait for memory, nothing more is read after a failure
+		bool ok;
+		{
+			boost::mutex::scoped_lock lock(m_mutex);
+			while (!m_failed && m_available < len)
+				m_released.wait(lock);
+			ok = !m_failed;
+			if (ok)
+				m_available -= len;
+		}
+
+#if !defined(_WIN32)
+		// the chunk is copied by the kernel when possible, see stream::copy_to,
+		// otherwise through buffer, which is the chunk memory admitted above
+		std::vector<unsigned char> buffer;
+		{
+			boost::mutex::scoped_lock lock(out->mutex);
+			if (ok && out->fd < 0)
+				out->fd = ::open(out->name.string().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+			ok = ok && out->fd >= 0;
+		}
+		if (ok)
+			ok = out->source->copy_to(out->fd, pos, len, pos, &buffer) == len;
+		{
+			boost::mutex::scoped_lock lock(out->mutex);
+			if (--out->pending == 0 && out->fd >= 0)
+				ok = (::close(out->fd) == 0) && ok;
+		}
+#else
+		// documents in memory are written in place
+		std::vector<char> buffer;
+		const char* data = NULL;
+		if (ok)
+		{
+			std::streamsize span_len;
+			data = out->source->span(pos, len, span_len);
+			if (!data || span_len < len)
+			{
+				buffer.resize((size_t)len);
+				data = &buffer[0];
+				ok = out->source->read_at(pos, &buffer[0], len) == len;
+			}
+		}
+
+		{
+			boost::mutex::scoped_lock lock(out->mutex);
+			if (ok && !out->file.is_open())
+				out->file.open(out->name.string().c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+			if (ok)
+			{
+				out->file.seekp(pos);
+				out->file.write(data, len);
+				ok = !out->file.fail();
+			}
+			if (--out->pending == 0)
+				out->file.close();
+		}
+#endif
+
+		boost::mutex::scoped_lock lock(m_mutex);
+		if (!ok)
+			m_failed = true;
+		else
+			m_available += len;
+		m_released.notify_all();
+	}
+}
+
+#endif // _OLE_EXTRACTOR_
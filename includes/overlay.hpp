@@ -0,0 +1,91 @@
+// POLEPP - Portable C++ library to access OLE Storage 
+// Copyright (C) 2004-2006 Jorge Lodos Vigil
+// Copyright (C) 2004 Israel Fernandez Cabrera
+
+//   Redistribution and use in source and binary forms, with or without 
+//   modification, are permitted provided that the following conditions 
+//   are met:
+//   * Redistributions of source code must retain the above copyright notice, 
+//     this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright notice, 
+//     this list of conditions and the following disclaimer in the documentation 
+//     and/or other materials provided with the distribution.
+//   * Neither the name of the authors nor the names of its contributors may be 
+//     used to endorse or promote products derived from this software without 
+//     specific prior written permission.
+//
+//   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+//   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+//   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+//   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+//   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+//   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+//   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+//   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+//   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+//   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+//   THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+#ifndef _OLE_OVERLAY_
+#define _OLE_OVERLAY_
+
+#include "storage.hpp"
+
+namespace ole
+{
+	// The overlay class applies changes to a document without modifying it.
+	// Files may be written, added or removed and directories added or 
+	// removed, the changes are kept in memory. The overlay reads as the 
+	// changed document and may be saved as a new document, where the files
+	// not changed are copied from the base block run by block run. Many 
+	// variants of a template document may be produced this way.
+	// Paths are always absolute. The base document must remain open while
+	// the overlay is used.
+	// This class is not thread safe.
+	template<typename _ = void>
+	class basic_overlay
+	{
+	// Construction/destruction
+	public:
+		basic_overlay(const compound_document& base): m_overlay(base.m_storage ? base.m_storage->document() : NULL) {}
+
+	// Attributes
+	public:
+		bool exists(const std::string& path) const { return m_overlay.type(path) != POLE::Overlay::NoEntry; }
+		bool is_directory(const std::string& path) const { return m_overlay.type(path) == POLE::Overlay::StorageEntry; }
+		bool is_file(const std::string& path) const { return m_overlay.type(path) == POLE::Overlay::StreamEntry; }
+		POLE::ULONG64 entry_size(const std::string& path) const { return m_overlay.size(path); }
+
+		// Names of the entries of the directory path, in name order.
+		bool entries(const std::string& path, std::vector<std::string>& names) const { return m_overlay.list(path, names); }
+
+	// Operations
+	public:
+		// Reads n bytes at offset of the file path.
+		std::streamsize read(const std::string& path, std::streamoff offset, char* buf, std::streamsize n) const { return m_overlay.read_at(path, offset, (unsigned char*)buf, n); }
+
+		// Creates or replaces a file, the data is copied. Intermediate 
+		// directories are created as needed.
+		bool create_file(const std::string& path, const char* data, POLE::ULONG64 size) { return m_overlay.write_stream(path, (const unsigned char*)data, size); }
+		bool create_directory(const std::string& path) { return m_overlay.add_directory(path); }
+
+		// Removes a file or a directory with everything below it.
+		bool remove(const std::string& path) { return m_overlay.remove(path); }
+
+		// Writes the changed document, in the version of the base.
+		bool save(const std::string& filename) const { return m_overlay.save(filename.c_str()); }
+		bool save(std::ostream& os) const { return m_overlay.save(os); }
+
+	// Implementation
+	private:
+		POLE::Overlay m_overlay;
+
+		basic_overlay(const basic_overlay<_>&); // no copy construction
+		basic_overlay<_>& operator=(const basic_overlay<_>&); // no assignment operator
+	};
+
+	typedef basic_overlay<> overlay;
+}
+
+#endif // _OLE_OVERLAY_
@@ -70,7 +70,7 @@ namespace ole
 		std::string absolute(const basic_compound_document<void>& doc) const { assert(m_entry); return doc.absolute_path(m_entry); }
 		
 		// Return the size for this path as stored in the document.
-		unsigned long entry_size() const { assert(m_entry); return m_entry->size(); }
+		POLE::ULONG64 entry_size() const { assert(m_entry); return m_entry->size(); }
 
 		// Returns true if this is the root entry
 		bool is_root() const { assert(m_entry); return m_entry->root(); }
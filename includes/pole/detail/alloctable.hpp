@@ -32,6 +32,7 @@
 
 #include <iostream>
 #include <vector>
+#include <cassert>
 #include "util.hpp"
 
 namespace POLE
@@ -122,6 +123,10 @@ bool AllocTableT<_>::follow( ULONG32 start, std::vector<ULONG32>& chain ) const
 {
   assert(chain.size() == 0);
 
+  // an empty stream has no blocks at all
+  if( start == Eof )
+	  return true;
+
   size_t blocks = count();
   if( start >= blocks ) 
 	  return false; 
@@ -0,0 +1,494 @@
+/* POLE - Portable C++ library to access OLE Storage 
+   Copyright (C) 2005-2006 Jorge Lodos Vigil
+   Copyright (C) 2002-2005 Ariya Hidayat <ariya@kde.org>
+
+   Redistribution and use in source and binary forms, with or without 
+   modification, are permitted provided that the following conditions 
+   are met:
+   * Redistributions of source code must retain the above copyright notice, 
+     this list of conditions and the following disclaimer.
+   * Redistributions in binary form must reproduce the above copyright notice, 
+     this list of conditions and the following disclaimer in the documentation 
+     and/or other materials provided with the distribution.
+   * Neither the name of the authors nor the names of its contributors may be 
+     used to endorse or promote products derived from this software without 
+     specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+   THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// backend header
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include "util.hpp"
+
+#if !defined(_WIN32)
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+namespace POLE
+{
+
+// Positional access to the bytes of a document. StorageIO reads and writes
+// whole blocks through this interface only, so documents may live in a file,
+// in memory or anywhere else a backend can reach.
+// read_at must be safe to call from several threads at the same time.
+class Backend
+{
+public:
+	virtual ~Backend() {}
+
+	// Returns false if the backend could not be opened.
+	virtual bool good() const = 0;
+	// Size of the document in bytes.
+	virtual ULONG64 size() = 0;
+	// Reads up to len bytes at pos, returns the number of bytes read.
+	virtual std::streamsize read_at( ULONG64 pos, unsigned char* data, std::streamsize len ) = 0;
+	// Writes len bytes at pos, returns the number of bytes written.
+	virtual std::streamsize write_at( ULONG64 pos, const unsigned char* data, std::streamsize len ) = 0;
+	virtual bool flush() { return true; }
+	// Hints that len bytes at pos will be read soon, so the backend may start
+	// loading them in the background. The default does nothing.
+	virtual void advise( ULONG64 /*pos*/, ULONG64 /*len*/ ) {}
+#if !defined(_WIN32)
+	// Copies len bytes at pos to the file descriptor fd at out_pos without
+	// passing them to the caller, returns the number of bytes copied. The
+	// default copies nothing, the caller must then copy the data itself.
+	virtual std::streamsize copy_to( ULONG64 /*pos*/, std::streamsize /*len*/, int /*fd*/, ULONG64 /*out_pos*/ ) { return 0; }
+#endif
+	// The document bytes if the whole document is addressable in memory,
+	// NULL otherwise.
+	virtual const unsigned char* data() const { return NULL; }
+};
+
+// Any std::iostream, the stream is not owned. The stream position is shared
+// so every access is serialized.
+class StreamBackend : public Backend
+{
+public:
+	StreamBackend( std::iostream* stream ): _stream(stream) {}
+
+	bool good() const { return _stream && !_stream->fail(); }
+	ULONG64 size()
+	{
+		boost::mutex::scoped_lock lock( _mutex );
+		_stream->clear();
+		_stream->seekg( 0, std::ios::end );
+		std::streamoff end = _stream->tellg();
+		return (end > 0) ? (ULONG64)end : 0;
+	}
+	std::streamsize read_at( ULONG64 pos, unsigned char* data, std::streamsize len )
+	{
+		boost::mutex::scoped_lock lock( _mutex );
+		_stream->clear();
+		_stream->seekg( (std::streamoff)pos );
+		_stream->read( (char*)data, len );
+		return _stream->gcount();
+	}
+	std::streamsize write_at( ULONG64 pos, const unsigned char* data, std::streamsize len )
+	{
+		boost::mutex::scoped_lock lock( _mutex );
+		_stream->clear();
+		_stream->seekp( (std::streamoff)pos );
+		_stream->write( (const char*)data, len );
+		return _stream->fail() ? 0 : len;
+	}
+	bool flush() { boost::mutex::scoped_lock lock( _mutex ); _stream->flush(); return !_stream->fail(); }
+
+protected:
+	std::iostream* _stream;
+	boost::mutex _mutex;
+};
+
+// A file opened with std::fstream, this is the portable default. Documents
+// opened from a file name for reading use a PosixBackend instead on POSIX.
+class FileBackend : public StreamBackend
+{
+public:
+	FileBackend( const char* filename, std::ios_base::openmode mode ): StreamBackend(NULL), _file(filename, std::ios::binary | mode) { _stream = &_file; }
+
+private:
+	std::fstream _file;
+};
+
+// A memory buffer. The buffer is not owned or copied, it must remain valid
+// while the backend is in use. Documents in constant memory are read only
+// and writing never grows the buffer.
+class MemoryBackend : public Backend
+{
+public:
+	MemoryBackend( const void* data, size_t size ): _data((const unsigned char*)data), _writable(NULL), _size(size) {}
+	MemoryBackend( void* data, size_t size ): _data((const unsigned char*)data), _writable((unsigned char*)data), _size(size) {}
+
+	bool good() const { return _data != NULL || _size == 0; }
+	ULONG64 size() { return _size; }
+	std::streamsize read_at( ULONG64 pos, unsigned char* data, std::streamsize len )
+	{
+		if (pos >= _size)
+			return 0;
+		if ((ULONG64)len > _size - pos)
+			len = (std::streamsize)(_size - pos);
+		memcpy( data, _data + pos, (size_t)len );
+		return len;
+	}
+	std::streamsize write_at( ULONG64 pos, const unsigned char* data, std::streamsize len )
+	{
+		if (!_writable || pos >= _size)
+			return 0;
+		if ((ULONG64)len > _size - pos)
+			len = (std::streamsize)(_size - pos);
+		memcpy( _writable + pos, data, (size_t)len );
+		return len;
+	}
+	const unsigned char* data() const { return _data; }
+
+private:
+	const unsigned char* _data;
+	unsigned char* _writable;
+	size_t _size;
+};
+
+// A file read whole into memory with a single read, every access is then
+// served from the copy like a MemoryBackend. The copy is read only.
+class BufferBackend : public Backend
+{
+public:
+	// good() is false if filename can not be read or is larger than limit.
+	BufferBackend( const char* filename, ULONG64 limit ): _good(false)
+	{
+		std::ifstream file( filename, std::ios::binary );
+		if (!file.seekg( 0, std::ios::end ))
+			return;
+		std::streamoff size = file.tellg();
+		if (size < 0 || (ULONG64)size > limit || !file.seekg( 0 ))
+			return;
+		_buffer.resize( (size_t)size );
+		_good = size == 0 || (file.read( (char*)&_buffer[0], size ) && file.gcount() == size);
+	}
+
+	bool good() const { return _good; }
+	ULONG64 size() { return _buffer.size(); }
+	std::streamsize read_at( ULONG64 pos, unsigned char* data, std::streamsize len )
+	{
+		if (pos >= _buffer.size())
+			return 0;
+		if ((ULONG64)len > _buffer.size() - pos)
+			len = (std::streamsize)(_buffer.size() - pos);
+		memcpy( data, &_buffer[(size_t)pos], (size_t)len );
+		return len;
+	}
+	std::streamsize write_at( ULONG64 /*pos*/, const unsigned char* /*data*/, std::streamsize /*len*/ ) { return 0; }
+	const unsigned char* data() const { return _buffer.empty() ? NULL : &_buffer[0]; }
+
+private:
+	std::vector<unsigned char> _buffer;
+	bool _good;
+};
+
+#if !defined(_WIN32)
+
+// A POSIX file descriptor accessed with pread/pwrite. There is no seek and
+// no user space buffering, each block is a single system call.
+class PosixBackend : public Backend
+{
+public:
+	PosixBackend( const char* filename, bool writable = false ): _fd(::open(filename, writable ? O_RDWR : O_RDONLY)), _own(true) {}
+	// The descriptor is closed if own is true.
+	PosixBackend( int fd, bool own ): _fd(fd), _own(own) {}
+	~PosixBackend() { if (_own && _fd >= 0) ::close(_fd); }
+
+	bool good() const { return _fd >= 0; }
+	ULONG64 size()
+	{
+		struct stat st;
+		return (::fstat(_fd, &st) == 0) ? (ULONG64)st.st_size : 0;
+	}
+	std::streamsize read_at( ULONG64 pos, unsigned char* data, std::streamsize len )
+	{
+		std::streamsize total = 0;
+		while (total < len)
+		{
+			ssize_t n = ::pread( _fd, data + total, (size_t)(len - total), (off_t)(pos + total) );
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			total += n;
+		}
+		return total;
+	}
+	std::streamsize write_at( ULONG64 pos, const unsigned char* data, std::streamsize len )
+	{
+		std::streamsize total = 0;
+		while (total < len)
+		{
+			ssize_t n = ::pwrite( _fd, data + total, (size_t)(len - total), (off_t)(pos + total) );
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			total += n;
+		}
+		return total;
+	}
+	bool flush() { return ::fsync(_fd) == 0; }
+	// The kernel reads the range in the background
+	void advise( ULONG64 pos, ULONG64 len )
+	{
+#if defined(POSIX_FADV_WILLNEED)
+		::posix_fadvise( _fd, (off_t)pos, (off_t)len, POSIX_FADV_WILLNEED );
+#endif
+	}
+	// The kernel copies between the files, the data never reaches user space
+	std::streamsize copy_to( ULONG64 pos, std::streamsize len, int fd, ULONG64 out_pos )
+	{
+		std::streamsize total = 0;
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+		loff_t in_off = (loff_t)pos;
+		loff_t out_off = (loff_t)out_pos;
+		while (total < len)
+		{
+			ssize_t n = ::copy_file_range( _fd, &in_off, fd, &out_off, (size_t)(len - total), 0 );
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			total += n;
+		}
+#endif
+		return total;
+	}
+
+protected:
+	int _fd;
+	bool _own;
+
+private:
+	// no copy or assign
+	PosixBackend( const PosixBackend& );
+	PosixBackend& operator=( const PosixBackend& );
+};
+
+// A file mapped in memory. Reads are plain copies from the mapping and
+// data() exposes the whole document. If writable, writes go to the mapping
+// but never grow the file.
+class MmapBackend : public Backend
+{
+public:
+	MmapBackend( const char* filename, bool writable = false ): _map(NULL), _size(0), _writable(writable)
+	{
+		int fd = ::open( filename, writable ? O_RDWR : O_RDONLY );
+		if (fd < 0)
+			return;
+		struct stat st;
+		if (::fstat(fd, &st) == 0 && st.st_size > 0)
+		{
+			void* map = ::mmap( NULL, (size_t)st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0 );
+			if (map != MAP_FAILED)
+			{
+				_map = (unsigned char*)map;
+				_size = (size_t)st.st_size;
+			}
+		}
+		::close( fd );
+	}
+	~MmapBackend() { if (_map) ::munmap( _map, _size ); }
+
+	bool good() const { return _map != NULL; }
+	ULONG64 size() { return _size; }
+	std::streamsize read_at( ULONG64 pos, unsigned char* data, std::streamsize len )
+	{
+		if (pos >= _size)
+			return 0;
+		if ((ULONG64)len > _size - pos)
+			len = (std::streamsize)(_size - pos);
+		memcpy( data, _map + pos, (size_t)len );
+		return len;
+	}
+	std::streamsize write_at( ULONG64 pos, const unsigned char* data, std::streamsize len )
+	{
+		if (!_writable || pos >= _size)
+			return 0;
+		if ((ULONG64)len > _size - pos)
+			len = (std::streamsize)(_size - pos);
+		memcpy( _map + pos, data, (size_t)len );
+		return len;
+	}
+	bool flush() { return !_writable || !_map || ::msync( _map, _size, MS_SYNC ) == 0; }
+	// Written from the mapping, there is no intermediate buffer
+	std::streamsize copy_to( ULONG64 pos, std::streamsize len, int fd, ULONG64 out_pos )
+	{
+		if (!_map || pos >= _size)
+			return 0;
+		if ((ULONG64)len > _size - pos)
+			len = (std::streamsize)(_size - pos);
+		return PosixBackend( fd, false ).write_at( out_pos, _map + pos, len );
+	}
+	// The pages are faulted in the background
+	void advise( ULONG64 pos, ULONG64 len )
+	{
+#if defined(MADV_WILLNEED)
+		if (!_map || pos >= _size)
+			return;
+		if (len > _size - pos)
+			len = _size - pos;
+		// madvise wants a page aligned address
+		ULONG64 page = (ULONG64)::sysconf( _SC_PAGESIZE );
+		ULONG64 start = pos - pos % page;
+		::madvise( _map + start, (size_t)(pos + len - start), MADV_WILLNEED );
+#endif
+	}
+	const unsigned char* data() const { return _map; }
+
+private:
+	unsigned char* _map;
+	size_t _size;
+	bool _writable;
+
+	// no copy or assign
+	MmapBackend( const MmapBackend& );
+	MmapBackend& operator=( const MmapBackend& );
+};
+
+// A file read once without going through the page cache, for large scans
+// that must not evict the data other processes use. The file is opened with
+// O_DIRECT (F_NOCACHE on Mac OS X) and read in windows of window bytes at
+// Alignment multiples into an aligned buffer, so every block of either
+// document version is inside a window. Where unbuffered reads are not
+// supported the file is read normally and the kernel is told to drop the
+// windows already read, direct() tells which. The backend is read only and
+// reads are serialized.
+class DirectBackend : public Backend
+{
+public:
+	enum { Alignment = 4096, DefaultWindow = 1 << 20 };
+
+	// window is rounded up to a multiple of Alignment.
+	DirectBackend( const char* filename, size_t window = DefaultWindow ): _fd(-1), _direct(false), _buffer(NULL), _start(0), _filled(0)
+	{
+		_window = (window + Alignment - 1) / Alignment * Alignment;
+		if (!_window)
+			_window = Alignment;
+		void* buffer = NULL;
+		if (::posix_memalign( &buffer, Alignment, _window ) != 0)
+			return;
+		_buffer = (unsigned char*)buffer;
+#if defined(O_DIRECT)
+		_fd = ::open( filename, O_RDONLY | O_DIRECT );
+		_direct = _fd >= 0;
+#endif
+		if (_fd < 0)
+			_fd = ::open( filename, O_RDONLY );
+#if defined(F_NOCACHE)
+		if (_fd >= 0)
+			_direct = ::fcntl( _fd, F_NOCACHE, 1 ) != -1;
+#endif
+	}
+	~DirectBackend()
+	{
+		if (_fd >= 0)
+			::close( _fd );
+		::free( _buffer );
+	}
+
+	bool good() const { return _fd >= 0 && _buffer; }
+	// True if the reads bypass the page cache.
+	bool direct() const { return _direct; }
+	ULONG64 size()
+	{
+		struct stat st;
+		return (::fstat(_fd, &st) == 0) ? (ULONG64)st.st_size : 0;
+	}
+	std::streamsize read_at( ULONG64 pos, unsigned char* data, std::streamsize len )
+	{
+		boost::mutex::scoped_lock lock( _mutex );
+		std::streamsize total = 0;
+		while (total < len)
+		{
+			ULONG64 p = pos + total;
+			if (p < _start || p >= _start + _filled)
+			{
+				if (!load( p - p % Alignment ) || p >= _start + _filled)
+					break;
+			}
+			size_t n = (size_t)(_start + _filled - p);
+			if ((ULONG64)n > (ULONG64)(len - total))
+				n = (size_t)(len - total);
+			memcpy( data + total, _buffer + (size_t)(p - _start), n );
+			total += n;
+		}
+		return total;
+	}
+	std::streamsize write_at( ULONG64 /*pos*/, const unsigned char* /*data*/, std::streamsize /*len*/ ) { return 0; }
+
+private:
+	// Reads the window at the aligned position start.
+	bool load( ULONG64 start )
+	{
+		_start = start;
+		_filled = 0;
+		while (_filled < _window)
+		{
+			ssize_t n = ::pread( _fd, _buffer + _filled, _window - _filled, (off_t)(_start + _filled) );
+			if (n < 0 && errno == EINTR)
+				continue;
+#if defined(O_DIRECT)
+			if (n < 0 && errno == EINVAL && _direct)
+			{
+				// the file system refuses unbuffered reads
+				::fcntl( _fd, F_SETFL, ::fcntl( _fd, F_GETFL ) & ~O_DIRECT );
+				_direct = false;
+				continue;
+			}
+#endif
+			if (n <= 0)
+				break;
+			_filled += (size_t)n;
+			// a short read is the end of the file, the next would not be aligned
+			if (_filled % Alignment)
+				break;
+		}
+#if defined(POSIX_FADV_DONTNEED)
+		if (!_direct && _filled)
+			::posix_fadvise( _fd, (off_t)_start, (off_t)_filled, POSIX_FADV_DONTNEED );
+#endif
+		return _filled > 0;
+	}
+
+	int _fd;
+	bool _direct;
+	unsigned char* _buffer; // aligned to Alignment
+	size_t _window;
+	ULONG64 _start;         // document position of the window
+	size_t _filled;
+	boost::mutex _mutex;
+
+	// no copy or assign
+	DirectBackend( const DirectBackend& );
+	DirectBackend& operator=( const DirectBackend& );
+};
+
+#endif // !_WIN32
+
+} // namespace POLE
@@ -0,0 +1,902 @@
+/* POLE - Portable C++ library to access OLE Storage 
+   Copyright (C) 2005-2006 Jorge Lodos Vigil
+   Copyright (C) 2002-2005 Ariya Hidayat <ariya@kde.org>
+
+   Redistribution and use in source and binary forms, with or without 
+   modification, are permitted provided that the following conditions 
+   are met:
+   * Redistributions of source code must retain the above copyright notice, 
+     this list of conditions and the following disclaimer.
+   * Redistributions in binary form must reproduce the above copyright notice, 
+     this list of conditions and the following disclaimer in the documentation 
+     and/or other materials provided with the distribution.
+   * Neither the name of the authors nor the names of its contributors may be 
+     used to endorse or promote products derived from this software without 
+     specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+   THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// builder header
+#pragma once
+
+#include <fstream>
+#include <map>
+#include <algorithm>
+#include <cctype>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include "stream.hpp"
+
+namespace POLE
+{
+
+// Provides the content of a stream added to a builder. It is called until
+// the declared size is reached and must return the number of bytes copied
+// into buffer, never more than len. Returning 0 before the declared size
+// was reached is an error.
+typedef boost::function<std::streamsize (unsigned char* buffer, std::streamsize len)> BuilderSource;
+
+// Receives the document bytes strictly in order. Must return false to abort.
+typedef boost::function<bool (const unsigned char* data, std::streamsize len)> BuilderSink;
+
+// Placement of every region of a document being built. Block numbers do not
+// count the header and every region is a contiguous run of big blocks.
+struct BuilderLayout
+{
+	unsigned major, b_shift;          // format version and big block size
+	ULONG32 bat_start, num_bat;       // FAT
+	ULONG32 mbat_start, num_mbat;     // DIFAT
+	ULONG32 sbat_start, num_sbat;     // mini FAT
+	ULONG32 dirent_start, num_dir;    // directory
+	ULONG32 mini_start, num_mini;     // mini stream
+	ULONG32 data_start, num_data;     // big streams
+	ULONG32 num_small;                // small blocks in the mini stream
+	ULONG32 num_blocks;               // big blocks in the file
+
+	// Size of the document in bytes
+	std::streamoff size() const { return ((std::streamoff)num_blocks + 1) << b_shift; }
+};
+
+// Creates a new compound document in two phases. The directory tree and the
+// stream sizes are declared first; plan() then computes the whole layout 
+// (FAT, DIFAT, mini FAT, directory, mini stream and data) and save() emits
+// the document strictly in order, pulling the content from the sources.
+// The output never seeks, so it may be a pipe, a socket or a compressor, and
+// every stream is one contiguous run of sectors.
+// Documents are written in version 4, whose 4096 bytes blocks match the page
+// size. Version 3 may be requested, but streams of more than 2GB still need
+// version 4.
+// Sources are consumed by save().
+template<typename _>
+class BuilderT
+{
+public:
+	enum { Ok, OpenFailed, BadPath, SourceFailed, WriteFailed, StupidWorkaroundForBrokenCompiler=255 };
+
+// Construction/destruction
+public:
+	BuilderT() { clear(); }
+
+// Attributes
+public:
+	// Result of the last operation. A rejected entry changes nothing, the
+	// entries declared before it may still be saved.
+	int result() const { return _result; }
+	size_t entryCount() const { return _nodes.size(); }
+	unsigned version() const { return _major; }
+
+// Operations
+public:
+	void clear();
+	void set_version( unsigned major ) { _major = (major >= 4) ? 4 : 3; _planned = false; }
+
+	// Intermediate storages are created as needed. Adding an existent storage
+	// succeeds, adding an existent stream fails. Paths are checked whole
+	// before anything is added.
+	bool add_directory( const std::string& path ) { return add_entry( path, 1, 0, BuilderSource() ) != DirEntry::End; }
+	bool add_stream( const std::string& path, ULONG64 size, const BuilderSource& source ) { return add_entry( path, 2, size, source ) != DirEntry::End; }
+	// The data must remain valid until save() is called.
+	bool add_stream( const std::string& path, const unsigned char* data, ULONG64 size );
+	// The file is opened when its content is written.
+	bool add_file( const std::string& path, const char* filename );
+	// Adds every storage and stream of a document below path. The streams
+	// are read when the new document is written.
+	bool add_document( StorageIO* io, const std::string& path = "/" ) { return transplant( io, "/", path ); }
+	// Adds the stream or storage from of another document as to, with
+	// everything below it and the attributes of the entries. The blocks of
+	// the streams are copied run by run from the other document when the new
+	// one is written, so it must remain open until then. Nothing is added if
+	// one of the paths can not be.
+	bool transplant( StorageIO* io, const std::string& from, const std::string& to );
+	// Copies the class id, state bits and time stamps of an entry.
+	bool set_attributes( const std::string& path, const DirEntry& from );
+
+	// Computes the layout, the result is valid until a new entry is added.
+	const BuilderLayout& plan();
+
+	bool save( const char* filename );
+	bool save( std::ostream& os );
+	bool save( const BuilderSink& sink );
+
+// Implementation
+private:
+	struct Node
+	{
+		std::string name;
+		ULONG8 type;
+		ULONG64 size;
+		BuilderSource source;
+		ULONG32 parent;
+		std::vector<ULONG32> children;
+		unsigned char attributes[36];
+	};
+
+	// Buffers the output so the file receives large sequential writes.
+	class Output
+	{
+	public:
+		Output( const BuilderSink& sink ): _sink(sink), _buffer(65536), _used(0), _written(0) {}
+		bool put( const unsigned char* data, size_t len );
+		bool fill( BuilderSource& source, ULONG64 len, bool& source_ok );
+		bool pad( size_t boundary );
+		bool flush();
+		size_t written() const { return _written + _used; }
+	private:
+		const BuilderSink& _sink;
+		std::vector<unsigned char> _buffer;
+		size_t _used;
+		size_t _written;
+	};
+
+	// Sources for add_stream(data) and add_file()
+	struct MemorySource
+	{
+		MemorySource( const unsigned char* data ): _data(data) {}
+		std::streamsize operator()( unsigned char* buffer, std::streamsize len ) { memcpy( buffer, _data, len ); _data += len; return len; }
+		const unsigned char* _data;
+	};
+	struct FileSource
+	{
+		FileSource( const char* filename ): _filename(filename) {}
+		std::streamsize operator()( unsigned char* buffer, std::streamsize len );
+		std::string _filename;
+		boost::shared_ptr<std::ifstream> _file;
+	};
+
+	// Source for transplant(), reads the runs of blocks of the stream straight
+	// from the backend of the document. The runs are found on first use.
+	struct StorageSource
+	{
+		StorageSource( StorageIO* io, const DirEntry* entry ): _io(io), _entry(entry), _pos(0), _next(0) {}
+		std::streamsize operator()( unsigned char* buffer, std::streamsize len );
+		StorageIO* _io;
+		const DirEntry* _entry;
+		boost::shared_ptr<std::vector<Extent> > _extents;
+		ULONG64 _pos;  // position in the stream
+		size_t _next;  // extent holding _pos
+	};
+
+	// Sink for save(std::ostream&)
+	struct StreamSink
+	{
+		StreamSink( std::ostream& os ): _os(&os) {}
+		bool operator()( const unsigned char* data, std::streamsize len ) { _os->write( (const char*)data, len ); return !_os->fail(); }
+		std::ostream* _os;
+	};
+
+	ULONG32 add_entry( const std::string& path, ULONG8 type, ULONG64 size, const BuilderSource& source );
+	static bool split_path( const std::string& path, std::vector<std::string>& names );
+	ULONG32 find_parent( const std::vector<std::string>& names, ULONG8 type, size_t& first ) const;
+	bool can_add( const std::string& path, ULONG8 type ) const;
+	ULONG32 find_child( ULONG32 parent, const std::string& name ) const;
+	ULONG32 find_entry( const std::string& path ) const;
+	static bool less_name( const std::string& lhs, const std::string& rhs );
+	ULONG32 link_siblings( const std::vector<ULONG32>& siblings, size_t first, size_t last, unsigned depth, unsigned red_depth );
+	static void set_chain( std::vector<ULONG32>& table, ULONG32 start, ULONG32 count );
+	bool write_table( Output& out, const std::vector<ULONG32>& table, ULONG32 block_size );
+	bool write( const BuilderSink& sink );
+
+	int _result;
+	unsigned _major;
+	std::vector<Node> _nodes;        // declared entries, the root is the first one
+	std::vector<ULONG32> _order;     // node of each directory entry
+	std::vector<DirEntry> _entries;  // directory entries as they will be saved
+
+	bool _planned;
+	BuilderLayout _layout;
+	std::vector<ULONG32> _bat;
+	std::vector<ULONG32> _sbat;
+
+	// no copy or assign
+	BuilderT( const BuilderT<_>& );
+	BuilderT<_>& operator=( const BuilderT<_>& );
+};
+
+typedef BuilderT<void> Builder;
+
+// =========== BuilderT ==========
+
+template<typename _>
+void BuilderT<_>::clear()
+{
+	_result = Ok;
+	_major = 4;
+	_planned = false;
+	_nodes.clear();
+	_order.clear();
+	_entries.clear();
+	_bat.clear();
+	_sbat.clear();
+
+	Node root;
+	root.name = "Root Entry";
+	root.type = 5;
+	root.size = 0;
+	root.parent = DirEntry::End;
+	memset( root.attributes, 0, sizeof(root.attributes) );
+	_nodes.push_back( root );
+}
+
+template<typename _>
+bool BuilderT<_>::add_stream( const std::string& path, const unsigned char* data, ULONG64 size )
+{
+	if (size && !data)
+	{
+		_result = SourceFailed;
+		return false;
+	}
+	return add_stream( path, size, MemorySource(data) );
+}
+
+template<typename _>
+bool BuilderT<_>::add_file( const std::string& path, const char* filename )
+{
+	std::ifstream file( filename, std::ios::in | std::ios::binary );
+	if (file.fail())
+	{
+		_result = OpenFailed;
+		return false;
+	}
+	file.seekg( 0, std::ios::end );
+	std::streamoff size = file.tellg();
+	file.close();
+	if (size < 0)
+	{
+		_result = OpenFailed;
+		return false;
+	}
+	return add_stream( path, (ULONG64)size, FileSource(filename) );
+}
+
+template<typename _>
+bool BuilderT<_>::transplant( StorageIO* io, const std::string& from, const std::string& to )
+{
+	if (!io || io->result() != StorageIO::Ok)
+	{
+		_result = OpenFailed;
+		return false;
+	}
+	const DirEntry* top = io->entry( from );
+	if (!top)
+	{
+		_result = BadPath;
+		return false;
+	}
+
+	std::string base = to;
+	while (!base.empty() && base[base.length()-1] == '/')
+		base.erase( base.length()-1 );
+	if (top->file())
+		return add_stream( base, top->size(), StorageSource(io, top) ) && set_attributes( base, *top );
+
+	// the entries below top keep their path relative to it, they are all
+	// checked before the first one is added
+	std::string prefix;
+	io->fullName( top, prefix );
+	if (!prefix.empty() && prefix[prefix.length()-1] == '/')
+		prefix.erase( prefix.length()-1 );
+	std::vector<const DirEntry*> entries;
+	io->listAll( entries );
+	std::vector<std::pair<std::string, const DirEntry*> > below;
+	if (!base.empty() && !can_add( base, 1 ))
+	{
+		_result = BadPath;
+		return false;
+	}
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		const DirEntry* e = entries[i];
+		if (e->root())
+			continue;
+		std::string name;
+		io->fullName( e, name );
+		if (name.compare( 0, prefix.length() + 1, prefix + "/" ) != 0)
+			continue;
+		name.replace( 0, prefix.length(), base );
+		if (!can_add( name, e->dir() ? 1 : 2 ))
+		{
+			_result = BadPath;
+			return false;
+		}
+		below.push_back( std::make_pair( name, e ) );
+	}
+
+	if (!base.empty() && !add_directory( base ))
+		return false;
+	if (!set_attributes( base.empty() ? "/" : base, *top ))
+		return false;
+	for (size_t i = 0; i < below.size(); ++i)
+	{
+		const std::string& name = below[i].first;
+		const DirEntry* e = below[i].second;
+		bool res = e->dir() ? add_directory( name ) : add_stream( name, e->size(), StorageSource(io, e) );
+		if (!res || !set_attributes( name, *e ))
+			return false;
+	}
+	return true;
+}
+
+template<typename _>
+bool BuilderT<_>::set_attributes( const std::string& path, const DirEntry& from )
+{
+	ULONG32 index = find_entry( path );
+	if (index == DirEntry::End)
+	{
+		_result = BadPath;
+		return false;
+	}
+	memcpy( _nodes[index].attributes, from.attributes(), sizeof(_nodes[index].attributes) );
+	_result = Ok;
+	return true;
+}
+
+template<typename _>
+ULONG32 BuilderT<_>::find_entry( const std::string& path ) const
+{
+	ULONG32 index = 0;
+	std::string::size_type pos = 0;
+	while (pos < path.length() && index != DirEntry::End)
+	{
+		std::string::size_type end = path.find( '/', pos );
+		if (end == std::string::npos)
+			end = path.length();
+		if (end > pos)
+			index = find_child( index, path.substr( pos, end - pos ) );
+		pos = end + 1;
+	}
+	return index;
+}
+
+template<typename _>
+ULONG32 BuilderT<_>::add_entry( const std::string& path, ULONG8 type, ULONG64 size, const BuilderSource& source )
+{
+	std::vector<std::string> names;
+	size_t first;
+	ULONG32 parent = split_path( path, names ) ? find_parent( names, type, first ) : DirEntry::End;
+	if (parent == DirEntry::End)
+	{
+		_result = BadPath;
+		return DirEntry::End;
+	}
+
+	// the names from first on are new
+	for (size_t i = first; i < names.size(); ++i)
+	{
+		bool leaf = (i + 1 == names.size());
+		Node node;
+		node.name = names[i];
+		node.type = leaf ? type : 1;
+		node.size = leaf ? size : 0;
+		if (leaf)
+			node.source = source;
+		node.parent = parent;
+		memset( node.attributes, 0, sizeof(node.attributes) );
+		ULONG32 index = (ULONG32)_nodes.size();
+		_nodes.push_back( node );
+		_planned = false;
+		_nodes[parent].children.push_back( index );
+		parent = index;
+	}
+	_result = Ok;
+	return parent;
+}
+
+// Paths are always relative to the root, the leading '/' is optional. Fails
+// if a name is too long or the path is the root, which can not be added.
+template<typename _>
+bool BuilderT<_>::split_path( const std::string& path, std::vector<std::string>& names )
+{
+	std::string::size_type pos = 0;
+	while (pos < path.length())
+	{
+		std::string::size_type end = path.find( '/', pos );
+		if (end == std::string::npos)
+			end = path.length();
+		if (end - pos > 31)
+			return false;
+		if (end > pos)
+			names.push_back( path.substr( pos, end - pos ) );
+		pos = end + 1;
+	}
+	return !names.empty();
+}
+
+// Returns the last declared storage of names and sets first to the next
+// name, or returns DirEntry::End if names can not be added as type.
+template<typename _>
+ULONG32 BuilderT<_>::find_parent( const std::vector<std::string>& names, ULONG8 type, size_t& first ) const
+{
+	ULONG32 parent = 0;
+	for (first = 0; first < names.size(); ++first)
+	{
+		ULONG32 index = find_child( parent, names[first] );
+		if (index == DirEntry::End)
+			break;
+		// only storages may be reused
+		if (_nodes[index].type != 1 || (first + 1 == names.size() && type != 1))
+			return DirEntry::End;
+		parent = index;
+	}
+	return parent;
+}
+
+template<typename _>
+bool BuilderT<_>::can_add( const std::string& path, ULONG8 type ) const
+{
+	std::vector<std::string> names;
+	size_t first;
+	return split_path( path, names ) && find_parent( names, type, first ) != DirEntry::End;
+}
+
+template<typename _>
+ULONG32 BuilderT<_>::find_child( ULONG32 parent, const std::string& name ) const
+{
+	const std::vector<ULONG32>& children = _nodes[parent].children;
+	for (size_t i = 0; i < children.size(); ++i)
+	{
+		const std::string& other = _nodes[children[i]].name;
+		if (other.length() != name.length())
+			continue;
+		size_t j = 0;
+		for (; j < name.length(); ++j)
+			if (toupper(name[j]) != toupper(other[j]))
+				break;
+		if (j == name.length())
+			return children[i];
+	}
+	return DirEntry::End;
+}
+
+// Siblings are ordered first by name length and then by the uppercase name.
+template<typename _>
+bool BuilderT<_>::less_name( const std::string& lhs, const std::string& rhs )
+{
+	if (lhs.length() != rhs.length())
+		return lhs.length() < rhs.length();
+	for (size_t i = 0; i < lhs.length(); ++i)
+	{
+		int l = toupper(lhs[i]);
+		int r = toupper(rhs[i]);
+		if (l != r)
+			return l < r;
+	}
+	return false;
+}
+
+// Links the sorted siblings [first, last) as a balanced binary tree and
+// returns its root. All the nodes are black except the ones at the deepest
+// level of an incomplete tree, which makes a valid red-black tree.
+template<typename _>
+ULONG32 BuilderT<_>::link_siblings( const std::vector<ULONG32>& siblings, size_t first, size_t last, unsigned depth, unsigned red_depth )
+{
+	if (first >= last)
+		return DirEntry::End;
+	size_t middle = first + (last - first) / 2;
+	DirEntry& e = _entries[siblings[middle]];
+	e.set_prev( link_siblings( siblings, first, middle, depth + 1, red_depth ) );
+	e.set_next( link_siblings( siblings, middle + 1, last, depth + 1, red_depth ) );
+	e.set_color( (depth == red_depth) ? DirEntry::Red : DirEntry::Black );
+	return siblings[middle];
+}
+
+template<typename _>
+void BuilderT<_>::set_chain( std::vector<ULONG32>& table, ULONG32 start, ULONG32 count )
+{
+	for (ULONG32 i = 0; i < count; ++i)
+		table[start + i] = (i + 1 < count) ? start + i + 1 : AllocTable::Eof;
+}
+
+// Computes the directory entries and the allocation tables. The file is
+// laid out as: header, FAT, DIFAT, mini FAT, directory, mini stream and the
+// big streams, in directory order.
+template<typename _>
+const BuilderLayout& BuilderT<_>::plan()
+{
+	if (_planned)
+		return _layout;
+
+	// version 3 can not describe streams of more than 2GB
+	BuilderLayout& l = _layout;
+	l.major = _major;
+	for (size_t i = 1; i < _nodes.size(); ++i)
+		if (_nodes[i].size > 0x80000000UL)
+			l.major = 4;
+	l.b_shift = (l.major >= 4) ? 12 : 9;
+
+	const ULONG32 big_size = 1 << l.b_shift;
+	const ULONG32 small_size = 64;
+	const ULONG32 threshold = 4096;
+	const ULONG32 per_block = big_size / 4;
+
+	// Directory order: the root, then the children of every storage together,
+	// storages being visited in the same order.
+	_order.clear();
+	_order.push_back( 0 );
+	std::vector<ULONG32> dir_index( _nodes.size(), 0 );
+	for (size_t i = 0; i < _order.size(); ++i)
+	{
+		std::vector<ULONG32> children = _nodes[_order[i]].children;
+		for (size_t j = 1; j < children.size(); ++j)
+			for (size_t k = j; k > 0 && less_name( _nodes[children[k]].name, _nodes[children[k-1]].name ); --k)
+				std::swap( children[k], children[k-1] );
+		for (size_t j = 0; j < children.size(); ++j)
+		{
+			dir_index[children[j]] = (ULONG32)_order.size();
+			_order.push_back( children[j] );
+		}
+	}
+
+	// Sizes of every region
+	l.num_small = 0;
+	l.num_data = 0;
+	for (size_t i = 1; i < _order.size(); ++i)
+	{
+		const Node& node = _nodes[_order[i]];
+		if (node.type != 2)
+			continue;
+		if (node.size < threshold)
+			l.num_small += (ULONG32)((node.size + small_size - 1) / small_size);
+		else
+			l.num_data += (ULONG32)((node.size + big_size - 1) / big_size);
+	}
+	l.num_sbat = (l.num_small + per_block - 1) / per_block;
+	l.num_dir = ((ULONG32)_order.size() * 128 + big_size - 1) / big_size;
+	l.num_mini = (l.num_small * small_size + big_size - 1) / big_size;
+	ULONG32 others = l.num_sbat + l.num_dir + l.num_mini + l.num_data;
+
+	// The FAT must also describe the FAT and DIFAT blocks
+	l.num_bat = 0;
+	l.num_mbat = 0;
+	for (;;)
+	{
+		ULONG32 total = others + l.num_bat + l.num_mbat;
+		ULONG32 num_bat = (total + per_block - 1) / per_block;
+		ULONG32 num_mbat = (num_bat > 109) ? (num_bat - 109 + per_block - 2) / (per_block - 1) : 0;
+		if (num_bat == l.num_bat && num_mbat == l.num_mbat)
+			break;
+		l.num_bat = num_bat;
+		l.num_mbat = num_mbat;
+	}
+	l.num_blocks = others + l.num_bat + l.num_mbat;
+	l.bat_start = 0;
+	l.mbat_start = l.bat_start + l.num_bat;
+	l.sbat_start = l.mbat_start + l.num_mbat;
+	l.dirent_start = l.sbat_start + l.num_sbat;
+	l.mini_start = l.dirent_start + l.num_dir;
+	l.data_start = l.mini_start + l.num_mini;
+
+	// Allocation tables
+	_bat.assign( l.num_bat * per_block, AllocTable::Avail );
+	_sbat.assign( l.num_sbat * per_block, AllocTable::Avail );
+	ULONG32 block = 0;
+	for (; block < l.mbat_start; ++block)
+		_bat[block] = AllocTable::Bat;
+	for (; block < l.sbat_start; ++block)
+		_bat[block] = AllocTable::MetaBat;
+	set_chain( _bat, l.sbat_start, l.num_sbat );
+	set_chain( _bat, l.dirent_start, l.num_dir );
+	set_chain( _bat, l.mini_start, l.num_mini );
+	block = l.data_start;
+
+	// Directory entries, the streams get their blocks in directory order
+	_entries.clear();
+	_entries.reserve( _order.size() );
+	ULONG32 small_block = 0;
+	for (size_t i = 0; i < _order.size(); ++i)
+	{
+		const Node& node = _nodes[_order[i]];
+		ULONG32 start = (node.type == 1) ? 0 : AllocTable::Eof;
+		ULONG64 size = node.size;
+		if (node.type == 5)
+		{
+			start = l.num_mini ? l.mini_start : AllocTable::Eof;
+			size = (ULONG64)l.num_small * small_size;
+		}
+		else if (node.type == 2 && size >= threshold)
+		{
+			ULONG32 count = (ULONG32)((size + big_size - 1) / big_size);
+			start = block;
+			set_chain( _bat, block, count );
+			block += count;
+		}
+		else if (node.type == 2 && size > 0)
+		{
+			ULONG32 count = (ULONG32)((size + small_size - 1) / small_size);
+			start = small_block;
+			set_chain( _sbat, small_block, count );
+			small_block += count;
+		}
+		ULONG32 parent = (node.type == 5) ? 0 : dir_index[node.parent];
+		_entries.push_back( DirEntry( node.name, node.type, size, start, DirEntry::End, DirEntry::End, DirEntry::End, (ULONG32)i, parent ) );
+		_entries.back().set_attributes( node.attributes );
+	}
+	assert(block == l.num_blocks);
+	assert(small_block == l.num_small);
+
+	// Link the children of every storage
+	for (size_t i = 0; i < _order.size(); ++i)
+	{
+		const Node& node = _nodes[_order[i]];
+		if (node.children.empty())
+			continue;
+		std::vector<ULONG32> siblings;
+		for (size_t j = 0; j < node.children.size(); ++j)
+			siblings.push_back( dir_index[node.children[j]] );
+		std::sort( siblings.begin(), siblings.end() ); // directory order is name order
+		unsigned red_depth = 0;
+		while ((size_t(2) << red_depth) <= siblings.size() + 1)
+			++red_depth;
+		_entries[i].set_child( link_siblings( siblings, 0, siblings.size(), 0, red_depth ) );
+	}
+
+	_planned = true;
+	return _layout;
+}
+
+template<typename _>
+bool BuilderT<_>::save( const char* filename )
+{
+	std::ofstream file( filename, std::ios::out | std::ios::binary | std::ios::trunc );
+	if (file.fail())
+	{
+		_result = OpenFailed;
+		return false;
+	}
+	if (!save( file ))
+		return false;
+	file.close();
+	if (file.fail())
+	{
+		_result = WriteFailed;
+		return false;
+	}
+	return true;
+}
+
+template<typename _>
+bool BuilderT<_>::save( std::ostream& os )
+{
+	return save( StreamSink(os) );
+}
+
+template<typename _>
+bool BuilderT<_>::save( const BuilderSink& sink )
+{
+	return write( sink );
+}
+
+template<typename _>
+bool BuilderT<_>::write_table( Output& out, const std::vector<ULONG32>& table, ULONG32 block_size )
+{
+	std::vector<unsigned char> buffer( block_size );
+	for (size_t i = 0; i < table.size(); i += block_size / 4)
+	{
+		for (size_t j = 0; j < block_size / 4; ++j)
+			writeU32( &buffer[j*4], table[i + j] );
+		if (!out.put( &buffer[0], block_size ))
+			return false;
+	}
+	return true;
+}
+
+template<typename _>
+bool BuilderT<_>::write( const BuilderSink& sink )
+{
+	const BuilderLayout& l = plan();
+	_result = WriteFailed;
+	Output out( sink );
+	const ULONG32 block_size = 1 << l.b_shift;
+	const ULONG32 per_block = block_size / 4;
+	const ULONG32 dir_per_block = block_size / 128;
+	std::vector<unsigned char> block( block_size );
+	unsigned char* buffer = &block[0];
+
+	// header, it fills the first block
+	Header header;
+	header.set_version( l.major );
+	header.set_num_dir( l.num_dir );
+	header.set_num_bat( l.num_bat );
+	header.set_dirent_start( l.dirent_start );
+	header.set_sbat_start( l.num_sbat ? l.sbat_start : AllocTable::Eof );
+	header.set_num_sbat( l.num_sbat );
+	header.set_mbat_start( l.num_mbat ? l.mbat_start : AllocTable::Eof );
+	header.set_num_mbat( l.num_mbat );
+	for (ULONG32 i = 0; i < 109 && i < l.num_bat; ++i)
+		header.set_bb_block( i, l.bat_start + i );
+	header.save( buffer, block_size );
+	if (!out.put( buffer, block_size ))
+		return false;
+
+	// FAT and DIFAT, the last entry of every DIFAT block links the next one
+	if (!write_table( out, _bat, block_size ))
+		return false;
+	ULONG32 bat_block = 109;
+	for (ULONG32 m = 0; m < l.num_mbat; ++m)
+	{
+		for (ULONG32 j = 0; j < per_block - 1; ++j, ++bat_block)
+			writeU32( buffer + j*4, (bat_block < l.num_bat) ? l.bat_start + bat_block : AllocTable::Avail );
+		writeU32( buffer + (per_block - 1)*4, (m + 1 < l.num_mbat) ? l.mbat_start + m + 1 : AllocTable::Eof );
+		if (!out.put( buffer, block_size ))
+			return false;
+	}
+
+	// mini FAT and directory
+	if (!write_table( out, _sbat, block_size ))
+		return false;
+	DirEntry unused( "", 0, 0, 0, DirEntry::End, DirEntry::End, DirEntry::End, 0, 0 );
+	unused.set_color( DirEntry::Red );
+	for (ULONG32 i = 0; i < l.num_dir * dir_per_block; ++i)
+	{
+		unsigned char* p = buffer + (i % dir_per_block) * 128;
+		if (i < _entries.size())
+			_entries[i].save( p );
+		else
+			unused.save( p );
+		if (i % dir_per_block == dir_per_block - 1 && !out.put( buffer, block_size ))
+			return false;
+	}
+
+	// streams, small ones first as they make the mini stream
+	for (int pass = 0; pass < 2; ++pass)
+	{
+		for (size_t i = 1; i < _order.size(); ++i)
+		{
+			Node& node = _nodes[_order[i]];
+			if (node.type != 2 || node.size == 0 || (node.size < 4096) != (pass == 0))
+				continue;
+			bool source_ok = true;
+			if (!out.fill( node.source, node.size, source_ok ))
+			{
+				if (!source_ok)
+					_result = SourceFailed;
+				return false;
+			}
+			node.source = BuilderSource(); // release files as soon as possible
+			if (!out.pad( pass == 0 ? 64 : block_size ))
+				return false;
+		}
+		if (!out.pad( block_size ))
+			return false;
+	}
+
+	if (!out.flush())
+		return false;
+	assert((std::streamoff)out.written() == l.size());
+	_result = Ok;
+	return true;
+}
+
+// =========== BuilderT::Output ==========
+
+template<typename _>
+bool BuilderT<_>::Output::put( const unsigned char* data, size_t len )
+{
+	while (len)
+	{
+		if (_used == _buffer.size() && !flush())
+			return false;
+		size_t count = std::min( len, _buffer.size() - _used );
+		memcpy( &_buffer[_used], data, count );
+		_used += count;
+		data += count;
+		len -= count;
+	}
+	return true;
+}
+
+// Sources write straight into the output buffer.
+template<typename _>
+bool BuilderT<_>::Output::fill( BuilderSource& source, ULONG64 len, bool& source_ok )
+{
+	while (len)
+	{
+		if (_used == _buffer.size() && !flush())
+			return false;
+		std::streamsize count = (std::streamsize)std::min( len, (ULONG64)(_buffer.size() - _used) );
+		std::streamsize read = source ? source( &_buffer[_used], count ) : 0;
+		if (read <= 0 || read > count)
+		{
+			source_ok = false;
+			return false;
+		}
+		_used += (size_t)read;
+		len -= (ULONG64)read;
+	}
+	return true;
+}
+
+template<typename _>
+bool BuilderT<_>::Output::pad( size_t boundary )
+{
+	static const unsigned char zeros[4096] = { 0 };
+	size_t extra = (_written + _used) % boundary;
+	return extra ? put( zeros, boundary - extra ) : true;
+}
+
+template<typename _>
+bool BuilderT<_>::Output::flush()
+{
+	if (_used && !_sink( &_buffer[0], (std::streamsize)_used ))
+		return false;
+	_written += _used;
+	_used = 0;
+	return true;
+}
+
+template<typename _>
+std::streamsize BuilderT<_>::StorageSource::operator()( unsigned char* buffer, std::streamsize len )
+{
+	if (!_extents)
+	{
+		_extents.reset( new std::vector<Extent> );
+		StreamImpl stream( _io, _entry );
+		if (!stream.extents( *_extents, 0 ))
+			_extents->clear();
+	}
+
+	// one read per run, never past the end of the run
+	std::streamsize total = 0;
+	while (total < len && _next < _extents->size())
+	{
+		const Extent& e = (*_extents)[_next];
+		ULONG64 skip = _pos - e.position;
+		std::streamsize count = (e.length - skip < (ULONG64)(len - total)) ? (std::streamsize)(e.length - skip) : len - total;
+		std::streamsize read = _io->backend()->read_at( e.offset + skip, buffer + total, count );
+		if (read > 0)
+		{
+			total += read;
+			_pos += read;
+		}
+		if (read < count)
+			break;
+		if (_pos == e.position + e.length)
+			++_next;
+	}
+	return total;
+}
+
+template<typename _>
+std::streamsize BuilderT<_>::FileSource::operator()( unsigned char* buffer, std::streamsize len )
+{
+	if (!_file)
+	{
+		_file.reset( new std::ifstream( _filename.c_str(), std::ios::in | std::ios::binary ) );
+		if (_file->fail())
+			return 0;
+	}
+	_file->read( (char*)buffer, len );
+	return _file->gcount();
+}
+
+}
@@ -43,6 +43,7 @@ class DirEntryT
 {
 public:
     static const unsigned End;
+    enum { Red = 0, Black = 1 };
   
 // Construction/destruction  
 public:
@@ -55,11 +56,15 @@ public:
 		_next(End),
 		_child(End),
 		_index(0),
-		_parent(0)
-	{}
-	DirEntryT(const std::string& name, ULONG8 type, ULONG32 size, ULONG32 start, ULONG32 prev, ULONG32 next, ULONG32 child, ULONG32 index, ULONG32 parent)
+		_parent(0),
+		_color(Black)
+	{
+		memset(_attributes, 0, sizeof(_attributes));
+	}
+	DirEntryT(const std::string& name, ULONG8 type, ULONG64 size, ULONG32 start, ULONG32 prev, ULONG32 next, ULONG32 child, ULONG32 index, ULONG32 parent)
 	{ 
 		set(name, type, size, start, prev, next, child, index, parent);
+		_color = Black;
 	}
 
 // Attributes
@@ -70,17 +75,19 @@ public:
 	bool root() const { return (_type == 5); }
 	bool dir() const { return ((_type == 1) || (_type == 5)); }
 	bool file() const { return (_type == 2); }
-	ULONG32 size() const { return _size; }
+	ULONG64 size() const { return _size; }
 	ULONG32 start() const { return _start; }
 	ULONG32 prev() const { return _prev; }
 	ULONG32 next() const { return _next; }
 	ULONG32 child() const { return _child; }
 	ULONG32 index() const { return _index; }
 	ULONG32 parent() const { return _parent; }
+	ULONG8 color() const { return _color; }
+	const unsigned char* attributes() const { return _attributes; }
 
 // Operations
 public:
-	void set(const std::string& name, ULONG8 type, ULONG32 size, ULONG32 start, ULONG32 prev, ULONG32 next, ULONG32 child, ULONG32 index, ULONG32 parent)
+	void set(const std::string& name, ULONG8 type, ULONG64 size, ULONG32 start, ULONG32 prev, ULONG32 next, ULONG32 child, ULONG32 index, ULONG32 parent)
 	{
 		_name = name;
 		_type = type;
@@ -91,11 +98,17 @@ public:
 		_child = child;
 		_index = index;
 		_parent = parent;
+		memset(_attributes, 0, sizeof(_attributes));
 	}
 	void set_prev(ULONG32 prev) { _prev = prev; }
 	void set_next(ULONG32 next) { _next = next; }
 	void set_child(ULONG32 child) { _child = child; }
 	void set_parent(ULONG32 parent) { _parent = parent; }
+	void set_color(ULONG8 color) { _color = color; }
+	void set_attributes(const unsigned char* attributes) { memcpy(_attributes, attributes, sizeof(_attributes)); }
+
+	// Writes the 128 bytes directory record for this entry.
+	void save( unsigned char* buffer ) const;
 #ifndef NDEBUG
     void debug() const;
 #endif
@@ -104,13 +117,15 @@ public:
 private:
     std::string _name;  // the name, not in unicode anymore 
     ULONG8 _type;       // true if directory   
-    ULONG32 _size;		// size (not valid if directory)
+    ULONG64 _size;		// size (not valid if directory)
     ULONG32 _start;		// starting block
     ULONG32 _prev;      // previous sibling
     ULONG32 _next;      // next sibling
     ULONG32 _child;     // first child
 	ULONG32 _index;		// index of the entry in the directory
 	ULONG32 _parent;	// parent in the directory structure. Must be a folder. 
+	ULONG8 _color;		// red-black tree color of the entry
+	unsigned char _attributes[36]; // class id, state bits and time stamps, as stored
 };
 
 typedef DirEntryT<void> DirEntry;
@@ -148,7 +163,8 @@ public:
 	ULONG32 find_rightmost_sibling(ULONG32 left_sib);
 	bool set_prev_link(ULONG32 prev_link, ULONG32 entry, ULONG32 value);
 	
-	bool load( unsigned char* buffer, size_t len );
+	// Version 3 documents only use the low 32 bits of the stream sizes.
+	bool load( unsigned char* buffer, size_t len, bool large_sizes = false );
     bool save( unsigned char* buffer, size_t len );
 #ifndef NDEBUG
     void debug() const;
@@ -190,6 +206,31 @@ bool DirEntryT<_>::valid() const
 	return true;
 }
 
+template<typename _>
+void DirEntryT<_>::save( unsigned char* buffer ) const
+{
+  memset( buffer, 0, 128 );
+
+  // max length for name is 31 chars, plus the terminating null
+  std::string name = _name;
+  if( name.length() > 31 )
+    name.erase( 31, name.length() );
+    
+  // write name as Unicode 16-bit
+  for( unsigned j = 0; j < name.length(); j++ )
+    buffer[ j*2 ] = name[j];
+
+  writeU16( buffer + 0x40, (ULONG16)(name.empty() ? 0 : name.length()*2 + 2) );    
+  writeU32( buffer + 0x74, _start );
+  writeU64( buffer + 0x78, _size );
+  writeU32( buffer + 0x44, _prev );
+  writeU32( buffer + 0x48, _next );
+  writeU32( buffer + 0x4c, _child );
+  memcpy( buffer + 0x50, _attributes, sizeof(_attributes) );
+  buffer[ 0x42 ] = _type;
+  buffer[ 0x43 ] = _color;
+}
+
 #ifndef NDEBUG
 template<typename _>
 void DirEntryT<_>::debug() const
@@ -440,7 +481,7 @@ void DirTreeT<_>::leaveDirectory()
  }
 
 template<typename _>
-bool DirTreeT<_>::load( unsigned char* buffer, size_t size )
+bool DirTreeT<_>::load( unsigned char* buffer, size_t size, bool large_sizes )
 {
   _entries.clear();
   _current = 0;
@@ -464,12 +505,14 @@ bool DirTreeT<_>::load( unsigned char* buffer, size_t size )
     // 1 = directory (aka storage), 2 = file (aka stream),  5 = root
     ULONG8 type = buffer[ 0x42 + p];
     ULONG32 start = readU32( buffer + 0x74+p );
-    ULONG32 size = readU32( buffer + 0x78+p );
+    ULONG64 size = large_sizes ? readU64( buffer + 0x78+p ) : readU32( buffer + 0x78+p );
     ULONG32 prev = readU32( buffer + 0x44+p );
     ULONG32 next = readU32( buffer + 0x48+p );
     ULONG32 child = readU32( buffer + 0x4C+p );
     
 	DirEntry e(name, type, size, start, prev, next, child, i, 0);
+	e.set_color( buffer[ 0x43 + p] );
+	e.set_attributes( buffer + 0x50 + p );
 	_entries.push_back( e );
   }
   set_parents();
@@ -489,24 +532,7 @@ bool DirTreeT<_>::save( unsigned char* buffer, size_t len )
   {
     const DirEntry* e = entry( i );
     if( !e ) return false;
-    
-    // max length for name is 32 chars
-    std::string name = e->name();
-    if( name.length() > 32 )
-      name.erase( 32, name.length() );
-      
-    // write name as Unicode 16-bit
-    for( unsigned j = 0; j < name.length(); j++ )
-      buffer[ i*128 + j*2 ] = name[j];
-
-    writeU16( buffer + i*128 + 0x40, (ULONG16)(name.length()*2 + 2) );    
-    writeU32( buffer + i*128 + 0x74, e->start() );
-    writeU32( buffer + i*128 + 0x78, e->size() );
-    writeU32( buffer + i*128 + 0x44, e->prev() );
-    writeU32( buffer + i*128 + 0x48, e->next() );
-    writeU32( buffer + i*128 + 0x4c, e->child() );
-    buffer[ i*128 + 0x42 ] = e->type();
-    buffer[ i*128 + 0x43 ] = 1; // always black
+    e->save( buffer + i*128 );
   }  
   return true;
 }
@@ -522,7 +548,7 @@ void DirTreeT<_>::debug() const
     std::cout << i << ": ";
     e->debug();
   }
-  std::vector<size_t> res;
+  std::vector<ULONG32> res;
   children(0, res);
   std::cout << std::endl << std::endl << "--------------------------" << std::endl;
   for (unsigned int i = 0; i < res.size(); ++i)
@@ -627,8 +653,8 @@ bool DirTreeT<_>::delete_entry(const std::string& path, int level)
 	{
 		// This is not an recursive call
 		// Find the entry that points to the entry is being deleted
-		size_t prev_link = search_prev_link(e->index());
-		if (prev_link == -1)
+		ULONG32 prev_link = search_prev_link(e->index());
+		if (prev_link == DirEntry::End)
 			return false;
 		// Last entry?
 		if (e->next() == DirEntry::End &&
@@ -664,8 +690,8 @@ bool DirTreeT<_>::delete_entry(const std::string& path, int level)
 				// pointed by the next field of the entry being deleted, set this entry's previous field
 				// to point to the prev field of the entry being deleted.
 				// Then set previous link to point to the next field of the entry being deleted.
-				size_t right_most = find_rightmost_sibling(e->next());
-				if (right_most == -1)
+				ULONG32 right_most = find_rightmost_sibling(e->next());
+				if (right_most == DirEntry::End)
 					return false;
 				DirEntry *_right = entry(right_most);
 				if (!_right) return false;
@@ -685,9 +711,9 @@ template<typename _>
 ULONG32 DirTreeT<_>::search_prev_link( ULONG32 _entry )
 {
 	// Find parent
-	size_t par_index = parent(_entry);
-	if (par_index == -1)
-		return false;
+	ULONG32 par_index = parentDirectory(_entry);
+	if (par_index == DirEntry::End)
+		return DirEntry::End;
 	if (_entries[par_index].child() == _entry)
 		return par_index;
 	else
@@ -695,7 +721,7 @@ ULONG32 DirTreeT<_>::search_prev_link( ULONG32 _entry )
 		std::vector<ULONG32> brothers;
 		children(par_index, brothers);
 		if (brothers.size() == 0)
-			return false;
+			return DirEntry::End;
 		for (size_t ndx = 0; ndx < brothers.size(); ++ndx)
 		{
 			if (_entries[brothers[ndx]].next() == _entry || 
@@ -0,0 +1,80 @@
+/* POLE - Portable C++ library to access OLE Storage 
+   Copyright (C) 2005-2006 Jorge Lodos Vigil
+   Copyright (C) 2002-2005 Ariya Hidayat <ariya@kde.org>
+
+   Redistribution and use in source and binary forms, with or without 
+   modification, are permitted provided that the following conditions 
+   are met:
+   * Redistributions of source code must retain the above copyright notice, 
+     this list of conditions and the following disclaimer.
+   * Redistributions in binary form must reproduce the above copyright notice, 
+     this list of conditions and the following disclaimer in the documentation 
+     and/or other materials provided with the distribution.
+   * Neither the name of the authors nor the names of its contributors may be 
+     used to endorse or promote products derived from this software without 
+     specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+   THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// sector geometry header
+#pragma once
+
+#include "util.hpp"
+
+namespace POLE
+{
+
+// Geometries with a specialized code path
+enum { GeometryOther, Geometry512, Geometry4096 };
+
+// Block sizes known at compile time. Version 3 documents use 512/64 and
+// version 4 documents use 4096/64, the read and write loops are instantiated
+// for both so every position is computed with constant shifts and masks.
+template<unsigned BigShift, unsigned SmallShift>
+struct FixedGeometry
+{
+	unsigned big_shift() const { return BigShift; }
+	unsigned small_shift() const { return SmallShift; }
+	ULONG32 big_size() const { return 1 << BigShift; }
+	ULONG32 small_size() const { return 1 << SmallShift; }
+	ULONG32 big_mask() const { return (1 << BigShift) - 1; }
+	ULONG32 small_mask() const { return (1 << SmallShift) - 1; }
+};
+
+// Any other block sizes, still powers of two
+struct DynamicGeometry
+{
+	DynamicGeometry( unsigned b_shift, unsigned s_shift ): _b_shift(b_shift), _s_shift(s_shift) {}
+	unsigned big_shift() const { return _b_shift; }
+	unsigned small_shift() const { return _s_shift; }
+	ULONG32 big_size() const { return 1 << _b_shift; }
+	ULONG32 small_size() const { return 1 << _s_shift; }
+	ULONG32 big_mask() const { return (1 << _b_shift) - 1; }
+	ULONG32 small_mask() const { return (1 << _s_shift) - 1; }
+	unsigned _b_shift;
+	unsigned _s_shift;
+};
+
+inline int geometry_of( unsigned b_shift, unsigned s_shift )
+{
+	if (s_shift != 6)
+		return GeometryOther;
+	if (b_shift == 9)
+		return Geometry512;
+	if (b_shift == 12)
+		return Geometry4096;
+	return GeometryOther;
+}
+
+} // namespace POLE
@@ -47,8 +47,10 @@ public:
 // Attributes
 public:
 	const unsigned char* id() const { return _id; }
+	unsigned major() const { return _major; }
 	unsigned b_shift() const { return _b_shift; }
 	unsigned s_shift() const { return _s_shift; }
+	unsigned num_dir() const { return _num_dir; }
 	unsigned num_bat() const { return _num_bat; }
 	unsigned dirent_start() const { return _dirent_start; }
 	unsigned threshold() const { return _threshold; }
@@ -62,6 +64,17 @@ public:
     
 // Operations
 public:
+	// Version 3 uses 512 bytes blocks, version 4 uses 4096 bytes blocks.
+	void set_version(unsigned major) { _major = major; _b_shift = (major >= 4) ? 12 : 9; }
+	void set_num_dir(unsigned n) { _num_dir = n; }
+	void set_num_bat(unsigned n) { _num_bat = n; }
+	void set_dirent_start(unsigned block) { _dirent_start = block; }
+	void set_sbat_start(unsigned block) { _sbat_start = block; }
+	void set_num_sbat(unsigned n) { _num_sbat = n; }
+	void set_mbat_start(unsigned block) { _mbat_start = block; }
+	void set_num_mbat(unsigned n) { _num_mbat = n; }
+	void set_bb_block(unsigned index, ULONG32 block) { assert(index < 109); _bb_blocks[index] = block; }
+
     bool load( const unsigned char* buffer, size_t len );
     bool save( unsigned char* buffer, size_t len );
 #ifndef NDEBUG
@@ -71,8 +84,10 @@ public:
 // Implementation
 private:
     unsigned char _id[8];     // signature, or magic identifier
+    unsigned _major;          // format version, 3 or 4  [_uDllVersion]
     unsigned _b_shift;        // bbat->blockSize = 1 << b_shift [_uSectorShift]
     unsigned _s_shift;        // sbat->blockSize = 1 << s_shift [_uMiniSectorShift]
+    unsigned _num_dir;        // blocks allocated for directory, version 4 only [_csectDir]
     unsigned _num_bat;        // blocks allocated for big bat   [_csectFat]
     unsigned _dirent_start;   // starting block for directory info  [_secDirStart]
     unsigned _threshold;      // switch from small to big file (usually 4K)  [_ulMiniSectorCutoff]
@@ -93,8 +108,10 @@ const unsigned char HeaderT<_>::pole_magic[] = { 0xd0, 0xcf, 0x11, 0xe0, 0xa1, 0
 template<typename _>
 HeaderT<_>::HeaderT()
 {
+  _major = 3;
   _b_shift = 9;
   _s_shift = 6;
+  _num_dir = 0;
   _num_bat = 0;
   _dirent_start = 0;
   _threshold = 4096;
@@ -114,12 +131,14 @@ template<typename _>
 bool HeaderT<_>::valid() const
 {
   if( _threshold != 4096 ) return false;
-  if( _num_bat == 0 ) return false; //ok
-  if( (_num_bat > 109) && (_num_bat > ((_num_mbat * 127) + 109))) return false; //ok
-  if( (_num_bat < 109) && (_num_mbat != 0) ) return false; //ok
   if( _s_shift > _b_shift ) return false;
   if( _b_shift <= 6 ) return false;
   if( _b_shift >=31 ) return false;
+  if( _num_bat == 0 ) return false; //ok
+  // every meta bat block links the next one in its last entry
+  unsigned mbat_entries = (1 << (_b_shift - 2)) - 1;
+  if( (_num_bat > 109) && (_num_bat > ((_num_mbat * mbat_entries) + 109))) return false; //ok
+  if( (_num_bat < 109) && (_num_mbat != 0) ) return false; //ok
   return true;
 }
 
@@ -138,8 +157,10 @@ bool HeaderT<_>::load( const unsigned char* buffer, size_t len )
   if (len < 0x4C+109 * 4 || !buffer)
 	  return false;
 
+  _major       = readU16( buffer + 0x1a );
   _b_shift     = readU16( buffer + 0x1e );
   _s_shift     = readU16( buffer + 0x20 );
+  _num_dir      = readU32( buffer + 0x28 );
   _num_bat      = readU32( buffer + 0x2c );
   _dirent_start = readU32( buffer + 0x30 );
   _threshold    = readU32( buffer + 0x38 );
@@ -169,10 +190,11 @@ bool HeaderT<_>::save( unsigned char* buffer, size_t len )
   writeU32( buffer + 12, 0 );             // unknown
   writeU32( buffer + 16, 0 );             // unknown
   writeU16( buffer + 24, 0x003e );        // revision ?
-  writeU16( buffer + 26, 3 );             // version ?
+  writeU16( buffer + 26, _major );        // version
   writeU16( buffer + 28, 0xfffe );        // unknown
   writeU16( buffer + 0x1e, _b_shift );
   writeU16( buffer + 0x20, _s_shift );
+  writeU32( buffer + 0x28, (_major >= 4) ? _num_dir : 0 );
   writeU32( buffer + 0x2c, _num_bat );
   writeU32( buffer + 0x30, _dirent_start );
   writeU32( buffer + 0x38, _threshold );
@@ -192,6 +214,7 @@ template<typename _>
 void HeaderT<_>::debug() const
 {
   std::cout << std::endl;
+  std::cout << "major " << _major << std::endl;
   std::cout << "b_shift " << _b_shift << std::endl;
   std::cout << "s_shift " << _s_shift << std::endl;
   std::cout << "num_bat " << _num_bat << std::endl;
@@ -0,0 +1,375 @@
+/* POLE - Portable C++ library to access OLE Storage 
+   Copyright (C) 2005-2006 Jorge Lodos Vigil
+   Copyright (C) 2002-2005 Ariya Hidayat <ariya@kde.org>
+
+   Redistribution and use in source and binary forms, with or without 
+   modification, are permitted provided that the following conditions 
+   are met:
+   * Redistributions of source code must retain the above copyright notice, 
+     this list of conditions and the following disclaimer.
+   * Redistributions in binary form must reproduce the above copyright notice, 
+     this list of conditions and the following disclaimer in the documentation 
+     and/or other materials provided with the distribution.
+   * Neither the name of the authors nor the names of its contributors may be 
+     used to endorse or promote products derived from this software without 
+     specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+   THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// sidecar index header
+#pragma once
+
+#include <fstream>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "storage.hpp"
+
+namespace POLE
+{
+
+// A file next to a document holding what opening it needs besides the
+// directory: the header and the chains of the streams, the directory and the
+// mini stream as runs of consecutive blocks. A document opened from its
+// index reads its header but not its allocation tables, so the time to open
+// does not depend on the size of the document. The index holds no entry
+// table or paths: the directory is still read from the document and parsed,
+// so the time to open grows with the number of entries, and with the number
+// of fragments.
+// The index records the size and modification time of the document and a
+// checksum of its directory, and its header is compared with the document
+// header, a stale index is not used. Documents opened from an index are read
+// only.
+template<typename _>
+class SidecarIndexT
+{
+public:
+	// Writes the index of io, the document in filename, to indexname.
+	static bool write( const StorageIO* io, const char* filename, const char* indexname );
+	// Opens filename from indexname, NULL if the index is missing, stale or
+	// not valid.
+	static StorageIO* open( const char* filename, const char* indexname );
+	// Opens filename from indexname, or parses the document and writes a new
+	// index when the index can not be used. The document is returned even if
+	// writing the index failed.
+	static StorageIO* open_or_build( const char* filename, const char* indexname );
+
+// Implementation
+private:
+	enum { Magic = 0x58444950, Version = 2, Fixed = 48 + 512 }; // "PIDX"
+
+	typedef StorageIO::Runs Runs;
+	typedef StorageIO::Chains Chains;
+
+	static bool load( StorageIO* io, const std::vector<unsigned char>& data, ULONG64 size );
+	static bool fingerprint( const char* filename, ULONG64& size, ULONG64& mtime, ULONG64& mtime_nsec );
+	static bool read_directory( const StorageIO* io, const std::vector<ULONG32>& chain, std::vector<unsigned char>& data );
+	static ULONG64 checksum( const std::vector<unsigned char>& data );
+	static void put32( std::vector<unsigned char>& out, ULONG32 value );
+	static void put64( std::vector<unsigned char>& out, ULONG64 value );
+	static void to_runs( const std::vector<ULONG32>& chain, Runs& runs );
+	static void put_runs( std::vector<unsigned char>& out, const Runs& runs );
+	static void put_chains( std::vector<unsigned char>& out, const Chains& chains );
+	static bool get_runs( const unsigned char*& p, const unsigned char* end, Runs& runs );
+	static bool get_chains( const unsigned char*& p, const unsigned char* end, Chains& chains );
+};
+
+typedef SidecarIndexT<void> SidecarIndex;
+
+// =========== SidecarIndexT ==========
+
+template<typename _>
+bool SidecarIndexT<_>::fingerprint( const char* filename, ULONG64& size, ULONG64& mtime, ULONG64& mtime_nsec )
+{
+#if defined(_WIN32)
+	struct _stat64 st;
+	if (::_stat64( filename, &st ) != 0)
+		return false;
+	mtime_nsec = 0;
+#else
+	struct stat st;
+	if (::stat( filename, &st ) != 0)
+		return false;
+#if defined(__APPLE__)
+	mtime_nsec = (ULONG64)st.st_mtimespec.tv_nsec;
+#else
+	mtime_nsec = (ULONG64)st.st_mtim.tv_nsec;
+#endif
+#endif
+	size = (ULONG64)st.st_size;
+	mtime = (ULONG64)st.st_mtime;
+	return true;
+}
+
+template<typename _>
+bool SidecarIndexT<_>::read_directory( const StorageIO* io, const std::vector<ULONG32>& chain, std::vector<unsigned char>& data )
+{
+	ULONG32 block_size = io->_bbat->block_size();
+	data.resize( chain.size() * block_size );
+	for (size_t i = 0; i < chain.size(); ++i)
+	{
+		ULONG64 pos = ((ULONG64)chain[i] + 1) * block_size;
+		if (io->_backend->read_at( pos, &data[i * block_size], block_size ) != (std::streamsize)block_size)
+			return false;
+	}
+	return !data.empty();
+}
+
+// FNV-1a, edits of the directory in place keep the size and the header of
+// the document and may keep its modification time
+template<typename _>
+ULONG64 SidecarIndexT<_>::checksum( const std::vector<unsigned char>& data )
+{
+	ULONG64 hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < data.size(); ++i)
+	{
+		hash ^= data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+template<typename _>
+void SidecarIndexT<_>::put32( std::vector<unsigned char>& out, ULONG32 value )
+{
+	out.resize( out.size() + 4 );
+	writeU32( &out[out.size() - 4], value );
+}
+
+template<typename _>
+void SidecarIndexT<_>::put64( std::vector<unsigned char>& out, ULONG64 value )
+{
+	out.resize( out.size() + 8 );
+	writeU64( &out[out.size() - 8], value );
+}
+
+template<typename _>
+void SidecarIndexT<_>::to_runs( const std::vector<ULONG32>& chain, Runs& runs )
+{
+	for (size_t i = 0; i < chain.size(); ++i)
+	{
+		if (!runs.empty() && runs.back().first + runs.back().second == chain[i])
+			++runs.back().second;
+		else
+			runs.push_back( std::make_pair( chain[i], (ULONG32)1 ) );
+	}
+}
+
+template<typename _>
+void SidecarIndexT<_>::put_runs( std::vector<unsigned char>& out, const Runs& runs )
+{
+	put32( out, (ULONG32)runs.size() );
+	for (size_t i = 0; i < runs.size(); ++i)
+	{
+		put32( out, runs[i].first );
+		put32( out, runs[i].second );
+	}
+}
+
+template<typename _>
+void SidecarIndexT<_>::put_chains( std::vector<unsigned char>& out, const Chains& chains )
+{
+	put32( out, (ULONG32)chains.size() );
+	typename Chains::const_iterator it;
+	for (it = chains.begin(); it != chains.end(); ++it)
+	{
+		put32( out, it->first );
+		put_runs( out, it->second );
+	}
+}
+
+template<typename _>
+bool SidecarIndexT<_>::get_runs( const unsigned char*& p, const unsigned char* end, Runs& runs )
+{
+	if (end - p < 4)
+		return false;
+	ULONG32 count = readU32( p );
+	p += 4;
+	if ((ULONG64)(end - p) < (ULONG64)count * 8)
+		return false;
+	runs.resize( count );
+	for (ULONG32 i = 0; i < count; ++i, p += 8)
+		runs[i] = std::make_pair( readU32( p ), readU32( p + 4 ) );
+	return true;
+}
+
+template<typename _>
+bool SidecarIndexT<_>::get_chains( const unsigned char*& p, const unsigned char* end, Chains& chains )
+{
+	if (end - p < 4)
+		return false;
+	ULONG32 count = readU32( p );
+	p += 4;
+	for (ULONG32 i = 0; i < count; ++i)
+	{
+		if (end - p < 4)
+			return false;
+		ULONG32 start = readU32( p );
+		p += 4;
+		if (!get_runs( p, end, chains[start] ))
+			return false;
+	}
+	return true;
+}
+
+template<typename _>
+bool SidecarIndexT<_>::write( const StorageIO* io, const char* filename, const char* indexname )
+{
+	if (!io || io->result() != StorageIO::Ok || io->_indexed || !io->tables())
+		return false;
+	ULONG64 size, mtime, mtime_nsec;
+	if (!fingerprint( filename, size, mtime, mtime_nsec ))
+		return false;
+
+	// the chains of the streams by start block, as StreamImpl follows them
+	Chains big, small;
+	const DirTree* tree = io->_dirtree;
+	ULONG32 count = (ULONG32)tree->entryCount();
+	for (ULONG32 i = 0; i < count; ++i)
+	{
+		const DirEntry* e = tree->entry( i );
+		if (!e || !e->file() || e->start() == AllocTable::Eof)
+			continue;
+		bool is_small = e->size() < io->_header->threshold();
+		Chains& chains = is_small ? small : big;
+		if (chains.find( e->start() ) != chains.end())
+			continue;
+		std::vector<ULONG32> chain;
+		if (is_small ? !io->_sbat->follow( e->start(), chain ) : !io->_bbat->follow( e->start(), chain ))
+			continue; // the stream is not readable, nor will it be from the index
+		to_runs( chain, chains[e->start()] );
+	}
+	std::vector<ULONG32> chain;
+	if (!io->_bbat->follow( io->_header->dirent_start(), chain ))
+		return false;
+	to_runs( chain, big[io->_header->dirent_start()] );
+	std::vector<unsigned char> directory;
+	if (!read_directory( io, chain, directory ))
+		return false;
+	Runs mini;
+	to_runs( io->_sb_blocks, mini );
+
+	std::vector<unsigned char> out;
+	put32( out, Magic );
+	put32( out, Version );
+	put64( out, 0 ); // length, set below
+	put64( out, size );
+	put64( out, mtime );
+	put64( out, mtime_nsec );
+	put64( out, checksum( directory ) );
+	out.resize( out.size() + 512 ); // as stored in the document
+	if (io->_backend->read_at( 0, &out[out.size() - 512], 512 ) != 512)
+		return false;
+	put_runs( out, mini );
+	put_chains( out, big );
+	put_chains( out, small );
+	writeU64( &out[8], out.size() );
+
+	std::ofstream file( indexname, std::ios::binary | std::ios::trunc );
+	file.write( (const char*)&out[0], (std::streamsize)out.size() );
+	return !file.fail();
+}
+
+template<typename _>
+StorageIO* SidecarIndexT<_>::open( const char* filename, const char* indexname )
+{
+	std::ifstream file( indexname, std::ios::binary );
+	if (!file || !file.seekg( 0, std::ios::end ))
+		return NULL;
+	std::streamoff file_size = file.tellg();
+	unsigned char fixed[Fixed];
+	if (file_size < (std::streamoff)sizeof(fixed) || !file.seekg( 0 ) || !file.read( (char*)fixed, sizeof(fixed) ))
+		return NULL;
+	ULONG64 size, mtime, mtime_nsec;
+	if (readU32( fixed ) != Magic || readU32( fixed + 4 ) != Version || !fingerprint( filename, size, mtime, mtime_nsec ))
+		return NULL;
+	// the length is checked against the file before anything is allocated
+	ULONG64 length = readU64( fixed + 8 );
+	if (length != (ULONG64)file_size || readU64( fixed + 16 ) != size || readU64( fixed + 24 ) != mtime || readU64( fixed + 32 ) != mtime_nsec)
+		return NULL;
+
+	std::vector<unsigned char> data( (size_t)length );
+	memcpy( &data[0], fixed, sizeof(fixed) );
+	std::streamsize rest = (std::streamsize)(length - sizeof(fixed));
+	if (rest > 0 && (!file.read( (char*)&data[sizeof(fixed)], rest ) || file.gcount() != rest))
+		return NULL;
+
+	StorageIO* io = new StorageIO( (Backend*)NULL, false );
+	io->_backend = StorageIO::open_file( filename, std::ios::in );
+	io->_own_backend = true;
+	if (!load( io, data, size ))
+	{
+		delete io;
+		return NULL;
+	}
+	return io;
+}
+
+// Sets up io, whose backend is the document, from the index in data.
+template<typename _>
+bool SidecarIndexT<_>::load( StorageIO* io, const std::vector<unsigned char>& data, ULONG64 size )
+{
+	Backend* backend = io->_backend;
+	if (!backend->good())
+		return false;
+
+	// the document must start with the header recorded
+	unsigned char header[512];
+	if (backend->read_at( 0, header, 512 ) != 512 || memcmp( header, &data[48], 512 ) != 0)
+		return false;
+	if (!io->_header->load( header, 512 ) || !io->_header->is_ole() || !io->_header->valid())
+		return false;
+	io->_bbat->set_block_size( 1 << io->_header->b_shift() );
+	io->_sbat->set_block_size( 1 << io->_header->s_shift() );
+	io->_geometry = geometry_of( io->_header->b_shift(), io->_header->s_shift() );
+	io->_size = size;
+
+	const unsigned char* p = &data[Fixed];
+	const unsigned char* end = &data[0] + data.size();
+	Runs mini;
+	if (!get_runs( p, end, mini ) || !get_chains( p, end, io->_big_chains ) || !get_chains( p, end, io->_small_chains ) || p != end)
+		return false;
+
+	// the directory is read from the document, it must be the one indexed
+	std::vector<ULONG32> chain;
+	std::vector<unsigned char> directory;
+	if (!StorageIO::follow_runs( io->_big_chains, io->_header->dirent_start(), chain ) || !read_directory( io, chain, directory ))
+		return false;
+	if (checksum( directory ) != readU64( &data[40] ))
+		return false;
+	if (!io->_dirtree->load( &directory[0], directory.size(), io->_header->major() >= 4 ))
+		return false;
+
+	for (size_t i = 0; i < mini.size(); ++i)
+		for (ULONG32 k = 0; k < mini[i].second; ++k)
+			io->_sb_blocks.push_back( mini[i].first + k );
+
+	io->_indexed = true;
+	io->_result = StorageIO::Ok;
+	return true;
+}
+
+template<typename _>
+StorageIO* SidecarIndexT<_>::open_or_build( const char* filename, const char* indexname )
+{
+	StorageIO* io = open( filename, indexname );
+	if (io)
+		return io;
+	io = new StorageIO( filename, std::ios::in, false );
+	if (io->result() == StorageIO::Ok)
+		write( io, filename, indexname );
+	return io;
+}
+
+} // namespace POLE
@@ -0,0 +1,231 @@
+/* POLE - Portable C++ library to access OLE Storage 
+   Copyright (C) 2005-2006 Jorge Lodos Vigil
+   Copyright (C) 2002-2005 Ariya Hidayat <ariya@kde.org>
+
+   Redistribution and use in source and binary forms, with or without 
+   modification, are permitted provided that the following conditions 
+   are met:
+   * Redistributions of source code must retain the above copyright notice, 
+     this list of conditions and the following disclaimer.
+   * Redistributions in binary form must reproduce the above copyright notice, 
+     this list of conditions and the following disclaimer in the documentation 
+     and/or other materials provided with the distribution.
+   * Neither the name of the authors nor the names of its contributors may be 
+     used to endorse or promote products derived from this software without 
+     specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+   THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// parsed metadata cache header
+#pragma once
+
+#if !defined(_WIN32)
+
+#include <map>
+#include <list>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include "snapshot.hpp"
+
+namespace POLE
+{
+
+// Parsed documents shared by every open of the same file. A file is known by
+// its device and inode, a cached document is used only while the size and
+// modification time of the file are unchanged, so opening an unchanged file
+// again does not read or parse its header, tables and directory. Documents
+// are read only and shared between threads like pinned snapshots, a Storage
+// constructed on them keeps the root as current directory, see
+// Snapshots::pin. Every cached document keeps its file open, so the cache
+// holds at most max_files documents besides its memory budget. The least
+// recently used are dropped when either is exceeded, the documents still in
+// use remain valid.
+// All the functions may be called from any thread.
+template<typename _>
+class MetadataCacheT
+{
+public:
+	typedef Snapshots::Version Version;
+	enum { DefaultBudget = 64 << 20, DefaultMaxFiles = 256 };
+
+// Construction/destruction
+public:
+	MetadataCacheT( ULONG64 budget = DefaultBudget, size_t max_files = DefaultMaxFiles ): _budget(budget), _max_files(max_files), _memory(0) {}
+
+	// The cache of the process.
+	static MetadataCacheT<_>& global() { return _global; }
+
+// Attributes
+public:
+	ULONG64 budget() const { boost::mutex::scoped_lock lock( _mutex ); return _budget; }
+	// Most documents cached, each one holds an open file descriptor.
+	size_t max_files() const { boost::mutex::scoped_lock lock( _mutex ); return _max_files; }
+	// Memory used by the cached documents.
+	ULONG64 memory() const { boost::mutex::scoped_lock lock( _mutex ); return _memory; }
+	size_t count() const { boost::mutex::scoped_lock lock( _mutex ); return _items.size(); }
+
+// Operations
+public:
+	// Returns the document in filename, parsed or from the cache, NULL if it
+	// can not be opened or is not a valid document.
+	Version open( const char* filename );
+	void set_budget( ULONG64 budget );
+	void set_max_files( size_t max_files );
+	void clear();
+
+// Implementation
+private:
+	typedef std::pair<ULONG64, ULONG64> Identity; // device and inode
+
+	struct Item
+	{
+		Version version;
+		ULONG64 size;
+		ULONG64 mtime;      // seconds
+		ULONG64 mtime_nsec;
+		ULONG64 memory;
+		typename std::list<Identity>::iterator lru;
+	};
+
+	void trim();
+
+	static MetadataCacheT<_> _global;
+
+	ULONG64 _budget;
+	size_t _max_files;
+	ULONG64 _memory;
+	std::map<Identity, Item> _items;
+	std::list<Identity> _lru; // most recently used first
+	mutable boost::mutex _mutex;
+
+	// no copy or assign
+	MetadataCacheT( const MetadataCacheT<_>& );
+	MetadataCacheT<_>& operator=( const MetadataCacheT<_>& );
+};
+
+typedef MetadataCacheT<void> MetadataCache;
+
+// =========== MetadataCacheT ==========
+
+template<typename _>
+MetadataCacheT<_> MetadataCacheT<_>::_global;
+
+template<typename _>
+typename MetadataCacheT<_>::Version MetadataCacheT<_>::open( const char* filename )
+{
+	int fd = ::open( filename, O_RDONLY );
+	if (fd < 0)
+		return Version();
+	struct stat st;
+	if (::fstat( fd, &st ) != 0)
+	{
+		::close( fd );
+		return Version();
+	}
+	Item item;
+	item.size = (ULONG64)st.st_size;
+	item.mtime = (ULONG64)st.st_mtime;
+#if defined(__APPLE__)
+	item.mtime_nsec = (ULONG64)st.st_mtimespec.tv_nsec;
+#else
+	item.mtime_nsec = (ULONG64)st.st_mtim.tv_nsec;
+#endif
+	Identity id( (ULONG64)st.st_dev, (ULONG64)st.st_ino );
+
+	{
+		boost::mutex::scoped_lock lock( _mutex );
+		typename std::map<Identity, Item>::iterator it = _items.find( id );
+		if (it != _items.end())
+		{
+			Item& cached = it->second;
+			if (cached.size == item.size && cached.mtime == item.mtime && cached.mtime_nsec == item.mtime_nsec)
+			{
+				::close( fd );
+				_lru.splice( _lru.begin(), _lru, cached.lru );
+				return cached.version;
+			}
+			// the file changed
+			_memory -= cached.memory;
+			_lru.erase( cached.lru );
+			_items.erase( it );
+		}
+	}
+
+	// parse without holding the lock, the descriptor is owned by the document
+	item.version.reset( new StorageIO( new PosixBackend( fd, true ), true ) );
+	if (item.version->result() != StorageIO::Ok)
+		return Version();
+	item.memory = item.version->memory();
+
+	boost::mutex::scoped_lock lock( _mutex );
+	typename std::map<Identity, Item>::iterator it = _items.find( id );
+	if (it != _items.end())
+	{
+		// parsed by another thread meanwhile
+		if (it->second.size == item.size && it->second.mtime == item.mtime && it->second.mtime_nsec == item.mtime_nsec)
+			return it->second.version;
+		_memory -= it->second.memory;
+		_lru.erase( it->second.lru );
+		_items.erase( it );
+	}
+	if (item.memory > _budget || _max_files == 0)
+		return item.version;
+	_lru.push_front( id );
+	item.lru = _lru.begin();
+	_items[id] = item;
+	_memory += item.memory;
+	trim();
+	return item.version;
+}
+
+template<typename _>
+void MetadataCacheT<_>::trim()
+{
+	while ((_memory > _budget || _items.size() > _max_files) && !_lru.empty())
+	{
+		typename std::map<Identity, Item>::iterator it = _items.find( _lru.back() );
+		_memory -= it->second.memory;
+		_items.erase( it );
+		_lru.pop_back();
+	}
+}
+
+template<typename _>
+void MetadataCacheT<_>::set_budget( ULONG64 budget )
+{
+	boost::mutex::scoped_lock lock( _mutex );
+	_budget = budget;
+	trim();
+}
+
+template<typename _>
+void MetadataCacheT<_>::set_max_files( size_t max_files )
+{
+	boost::mutex::scoped_lock lock( _mutex );
+	_max_files = max_files;
+	trim();
+}
+
+template<typename _>
+void MetadataCacheT<_>::clear()
+{
+	boost::mutex::scoped_lock lock( _mutex );
+	_items.clear();
+	_lru.clear();
+	_memory = 0;
+}
+
+} // namespace POLE
+
+#endif // !_WIN32
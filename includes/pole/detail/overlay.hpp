@@ -0,0 +1,373 @@
+/* POLE - Portable C++ library to access OLE Storage 
+   Copyright (C) 2005-2006 Jorge Lodos Vigil
+   Copyright (C) 2002-2005 Ariya Hidayat <ariya@kde.org>
+
+   Redistribution and use in source and binary forms, with or without 
+   modification, are permitted provided that the following conditions 
+   are met:
+   * Redistributions of source code must retain the above copyright notice, 
+     this list of conditions and the following disclaimer.
+   * Redistributions in binary form must reproduce the above copyright notice, 
+     this list of conditions and the following disclaimer in the documentation 
+     and/or other materials provided with the distribution.
+   * Neither the name of the authors nor the names of its contributors may be 
+     used to endorse or promote products derived from this software without 
+     specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+   THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// copy on write overlay header
+#pragma once
+
+#include <map>
+#include <set>
+#include <boost/shared_ptr.hpp>
+#include "builder.hpp"
+
+namespace POLE
+{
+
+// A read only document with changes kept in memory: streams written, added
+// or removed and storages added or removed. The result reads as a single
+// document and is saved as a new one, where the unchanged streams are copied
+// run by run from the base, see Builder::transplant.
+// Paths are always absolute, the leading '/' is optional. Intermediate
+// storages are created as needed. The base must remain open while the
+// overlay is used. This class is not thread safe.
+template<typename _>
+class OverlayT
+{
+public:
+	enum { NoEntry = 0, StorageEntry = 1, StreamEntry = 2 };
+
+// Construction/destruction
+public:
+	OverlayT( StorageIO* base );
+
+// Attributes
+public:
+	// NoEntry, StorageEntry or StreamEntry.
+	int type( const std::string& path ) const;
+	ULONG64 size( const std::string& path ) const;
+	// Names of the entries of a storage, in name order.
+	bool list( const std::string& path, std::vector<std::string>& names ) const;
+	std::streamsize read_at( const std::string& path, ULONG64 pos, unsigned char* data, std::streamsize maxlen ) const;
+
+// Operations
+public:
+	// Creates or replaces a stream, the data is copied.
+	bool write_stream( const std::string& path, const unsigned char* data, ULONG64 size );
+	bool add_directory( const std::string& path );
+	// Removes a stream or a storage with everything below it.
+	bool remove( const std::string& path );
+	// Declares the resulting document in builder. The base must remain open
+	// until the builder saves.
+	bool save( Builder& builder ) const;
+	// Saves with the version of the base.
+	bool save( const char* filename ) const;
+	bool save( std::ostream& os ) const;
+
+// Implementation
+private:
+	struct Change
+	{
+		bool stream;
+		boost::shared_ptr<std::vector<unsigned char> > data;
+	};
+
+	// Source of a written stream, the data is shared with the overlay
+	struct ChangeSource
+	{
+		ChangeSource( const boost::shared_ptr<std::vector<unsigned char> >& data ): _data(data), _pos(0) {}
+		std::streamsize operator()( unsigned char* buffer, std::streamsize len )
+		{
+			memcpy( buffer, &(*_data)[_pos], (size_t)len );
+			_pos += (size_t)len;
+			return len;
+		}
+		boost::shared_ptr<std::vector<unsigned char> > _data;
+		size_t _pos;
+	};
+
+	typedef std::map<std::string, Change> Changes;
+
+	static std::string normalize( const std::string& path );
+	static std::string prefix( const std::string& path ) { return (path == "/") ? path : path + "/"; }
+	const DirEntry* base_entry( const std::string& path ) const;
+	bool has_added_below( const std::string& path ) const;
+	bool parents_are_storages( const std::string& path ) const;
+	void add_names( const std::string& from, const std::string& path, std::set<std::string>& names ) const;
+
+	StorageIO* _io;
+	std::map<std::string, const DirEntry*> _base; // every entry of the base by path
+	Changes _added;                              // streams written and storages added
+	std::set<std::string> _removed;               // the base is hidden at and below these paths
+	mutable std::map<std::string, boost::shared_ptr<StreamImpl> > _streams; // base streams read
+
+	// no copy or assign
+	OverlayT( const OverlayT<_>& );
+	OverlayT<_>& operator=( const OverlayT<_>& );
+};
+
+typedef OverlayT<void> Overlay;
+
+// =========== OverlayT ==========
+
+template<typename _>
+OverlayT<_>::OverlayT( StorageIO* base ): _io(base)
+{
+	if (!_io || _io->result() != StorageIO::Ok)
+		return;
+	std::vector<const DirEntry*> entries;
+	_io->listAll( entries );
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		std::string name;
+		_io->fullName( entries[i], name );
+		_base[name] = entries[i];
+	}
+}
+
+template<typename _>
+std::string OverlayT<_>::normalize( const std::string& path )
+{
+	std::string result;
+	std::string::size_type pos = 0;
+	while (pos < path.length())
+	{
+		std::string::size_type end = path.find( '/', pos );
+		if (end == std::string::npos)
+			end = path.length();
+		if (end > pos)
+			result += "/" + path.substr( pos, end - pos );
+		pos = end + 1;
+	}
+	return result.empty() ? "/" : result;
+}
+
+template<typename _>
+const DirEntry* OverlayT<_>::base_entry( const std::string& path ) const
+{
+	// hidden if the path or one of its storages was removed, the root never is
+	if (!_removed.empty())
+	{
+		std::string::size_type end = path.find( '/', 1 );
+		for (; end != std::string::npos; end = path.find( '/', end + 1 ))
+			if (_removed.count( path.substr( 0, end ) ))
+				return NULL;
+		if (_removed.count( path ))
+			return NULL;
+	}
+	std::map<std::string, const DirEntry*>::const_iterator e = _base.find( path );
+	return (e != _base.end()) ? e->second : NULL;
+}
+
+template<typename _>
+bool OverlayT<_>::has_added_below( const std::string& path ) const
+{
+	std::string p = prefix( path );
+	typename Changes::const_iterator it = _added.lower_bound( p );
+	return it != _added.end() && it->first.compare( 0, p.length(), p ) == 0;
+}
+
+template<typename _>
+int OverlayT<_>::type( const std::string& path ) const
+{
+	std::string p = normalize( path );
+	typename Changes::const_iterator it = _added.find( p );
+	if (it != _added.end())
+		return it->second.stream ? StreamEntry : StorageEntry;
+	if (p == "/" || has_added_below( p ))
+		return StorageEntry;
+	const DirEntry* e = base_entry( p );
+	if (!e)
+		return NoEntry;
+	return e->dir() ? StorageEntry : StreamEntry;
+}
+
+template<typename _>
+ULONG64 OverlayT<_>::size( const std::string& path ) const
+{
+	std::string p = normalize( path );
+	typename Changes::const_iterator it = _added.find( p );
+	if (it != _added.end())
+		return it->second.stream ? it->second.data->size() : 0;
+	const DirEntry* e = base_entry( p );
+	return (e && e->file()) ? e->size() : 0;
+}
+
+template<typename _>
+void OverlayT<_>::add_names( const std::string& from, const std::string& path, std::set<std::string>& names ) const
+{
+	// from is below path, its first name after path is an entry of path
+	std::string p = prefix( path );
+	std::string::size_type end = from.find( '/', p.length() );
+	names.insert( from.substr( p.length(), end == std::string::npos ? end : end - p.length() ) );
+}
+
+template<typename _>
+bool OverlayT<_>::list( const std::string& path, std::vector<std::string>& names ) const
+{
+	std::string p = normalize( path );
+	if (type( p ) != StorageEntry)
+		return false;
+	std::set<std::string> result;
+	std::string pre = prefix( p );
+	if (base_entry( p ))
+	{
+		std::map<std::string, const DirEntry*>::const_iterator it = _base.lower_bound( pre );
+		for (; it != _base.end() && it->first.compare( 0, pre.length(), pre ) == 0; ++it)
+			if (it->first != pre && base_entry( it->first ))
+				add_names( it->first, p, result );
+	}
+	typename Changes::const_iterator it = _added.lower_bound( pre );
+	for (; it != _added.end() && it->first.compare( 0, pre.length(), pre ) == 0; ++it)
+		add_names( it->first, p, result );
+	names.assign( result.begin(), result.end() );
+	return true;
+}
+
+template<typename _>
+std::streamsize OverlayT<_>::read_at( const std::string& path, ULONG64 pos, unsigned char* data, std::streamsize maxlen ) const
+{
+	std::string p = normalize( path );
+	typename Changes::const_iterator it = _added.find( p );
+	if (it != _added.end())
+	{
+		const std::vector<unsigned char>* v = it->second.data.get();
+		if (!it->second.stream || pos >= v->size() || maxlen <= 0)
+			return 0;
+		if ((ULONG64)maxlen > v->size() - pos)
+			maxlen = (std::streamsize)(v->size() - pos);
+		memcpy( data, &(*v)[(size_t)pos], (size_t)maxlen );
+		return maxlen;
+	}
+
+	const DirEntry* e = base_entry( p );
+	if (!e || !e->file())
+		return 0;
+	boost::shared_ptr<StreamImpl>& stream = _streams[p];
+	if (!stream)
+		stream.reset( new StreamImpl( _io, e ) );
+	return stream->read_at( pos, data, maxlen );
+}
+
+template<typename _>
+bool OverlayT<_>::parents_are_storages( const std::string& path ) const
+{
+	std::string::size_type end = path.find( '/', 1 );
+	for (; end != std::string::npos; end = path.find( '/', end + 1 ))
+		if (type( path.substr( 0, end ) ) == StreamEntry)
+			return false;
+	return true;
+}
+
+template<typename _>
+bool OverlayT<_>::write_stream( const std::string& path, const unsigned char* data, ULONG64 size )
+{
+	std::string p = normalize( path );
+	if (p == "/" || (size && !data) || type( p ) == StorageEntry || !parents_are_storages( p ))
+		return false;
+	if (base_entry( p ))
+	{
+		_removed.insert( p );
+		_streams.erase( p );
+	}
+	Change& change = _added[p];
+	change.stream = true;
+	change.data.reset( new std::vector<unsigned char>( data, data + (size_t)size ) );
+	return true;
+}
+
+template<typename _>
+bool OverlayT<_>::add_directory( const std::string& path )
+{
+	std::string p = normalize( path );
+	int t = type( p );
+	if (t == StorageEntry)
+		return true;
+	if (t == StreamEntry || !parents_are_storages( p ))
+		return false;
+	_added[p].stream = false;
+	return true;
+}
+
+template<typename _>
+bool OverlayT<_>::remove( const std::string& path )
+{
+	std::string p = normalize( path );
+	if (p == "/" || type( p ) == NoEntry)
+		return false;
+
+	// forget the changes at and below p
+	std::string pre = prefix( p );
+	_added.erase( p );
+	typename Changes::iterator it = _added.lower_bound( pre );
+	while (it != _added.end() && it->first.compare( 0, pre.length(), pre ) == 0)
+		_added.erase( it++ );
+	std::set<std::string>::iterator r = _removed.lower_bound( pre );
+	while (r != _removed.end() && r->compare( 0, pre.length(), pre ) == 0)
+		_removed.erase( r++ );
+	_removed.insert( p );
+	_streams.clear();
+	return true;
+}
+
+template<typename _>
+bool OverlayT<_>::save( Builder& builder ) const
+{
+	if (!_io || _io->result() != StorageIO::Ok)
+		return false;
+	if (!builder.set_attributes( "/", *_io->root_entry() ))
+		return false;
+
+	// what remains of the base, streams copied run by run
+	std::map<std::string, const DirEntry*>::const_iterator b;
+	for (b = _base.begin(); b != _base.end(); ++b)
+	{
+		const DirEntry* e = b->second;
+		if (e->root() || !base_entry( b->first ))
+			continue;
+		bool res = e->dir() ? builder.add_directory( b->first ) && builder.set_attributes( b->first, *e ) : builder.transplant( _io, b->first, b->first );
+		if (!res)
+			return false;
+	}
+
+	typename Changes::const_iterator it;
+	for (it = _added.begin(); it != _added.end(); ++it)
+	{
+		bool res = it->second.stream ? builder.add_stream( it->first, it->second.data->size(), ChangeSource(it->second.data) ) : builder.add_directory( it->first );
+		if (!res)
+			return false;
+	}
+	return true;
+}
+
+template<typename _>
+bool OverlayT<_>::save( const char* filename ) const
+{
+	Builder builder;
+	builder.set_version( _io ? _io->header()->major() : 4 );
+	return save( builder ) && builder.save( filename );
+}
+
+template<typename _>
+bool OverlayT<_>::save( std::ostream& os ) const
+{
+	Builder builder;
+	builder.set_version( _io ? _io->header()->major() : 4 );
+	return save( builder ) && builder.save( os );
+}
+
+} // namespace POLE
@@ -0,0 +1,103 @@
+/* POLE - Portable C++ library to access OLE Storage 
+   Copyright (C) 2005-2006 Jorge Lodos Vigil
+   Copyright (C) 2002-2005 Ariya Hidayat <ariya@kde.org>
+
+   Redistribution and use in source and binary forms, with or without 
+   modification, are permitted provided that the following conditions 
+   are met:
+   * Redistributions of source code must retain the above copyright notice, 
+     this list of conditions and the following disclaimer.
+   * Redistributions in binary form must reproduce the above copyright notice, 
+     this list of conditions and the following disclaimer in the documentation 
+     and/or other materials provided with the distribution.
+   * Neither the name of the authors nor the names of its contributors may be 
+     used to endorse or promote products derived from this software without 
+     specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+   THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// single writer / multiple readers snapshot header
+#pragma once
+
+#include <boost/shared_ptr.hpp>
+#include "storage.hpp"
+
+namespace POLE
+{
+
+// Versions of a document written by one thread while others read it. A
+// version is a StorageIO parsed from the document when it was published: its
+// header, allocation tables and directory are never modified, so readers
+// holding it are not disturbed by the writer changing or deleting entries.
+// Readers pin the last version without waiting for the writer, the writer
+// publishes a new one after its changes. The writer never moves or frees the
+// blocks of existing streams, so the block chains of a pinned version remain
+// valid; bytes overwritten in place are seen by every version.
+// The versions read through the backend of the writer, which must remain
+// open until all the versions are released.
+template<typename _>
+class SnapshotsT
+{
+public:
+	typedef boost::shared_ptr<StorageIO> Version;
+
+// Construction/destruction
+public:
+	// writer is not owned, its current state is published.
+	SnapshotsT( StorageIO* writer ): _writer(writer) { publish(); }
+
+// Attributes
+public:
+	// The last version published, NULL if the document is not valid. It may
+	// be called from any thread. The version is shared by all its readers, a
+	// Storage constructed on it keeps the root as current directory.
+	Version pin() const { return boost::atomic_load( &_current ); }
+
+// Operations
+public:
+	// Writes the directory of the writer and publishes the result as the
+	// current version. Only the writer thread calls it. Returns false and
+	// keeps the current version if the document could not be read back.
+	bool publish();
+
+// Implementation
+private:
+	StorageIO* _writer;
+	Version _current; // accessed atomically
+
+	// no copy or assign
+	SnapshotsT( const SnapshotsT<_>& );
+	SnapshotsT<_>& operator=( const SnapshotsT<_>& );
+};
+
+typedef SnapshotsT<void> Snapshots;
+
+// =========== SnapshotsT ==========
+
+template<typename _>
+bool SnapshotsT<_>::publish()
+{
+	if (!_writer || _writer->result() != StorageIO::Ok)
+		return false;
+	if (!_writer->flush() || !_writer->backend()->flush())
+		return false;
+
+	Version version( new StorageIO( _writer->backend(), false ) );
+	if (version->result() != StorageIO::Ok)
+		return false;
+	boost::atomic_store( &_current, version );
+	return true;
+}
+
+} // namespace POLE
@@ -32,8 +32,12 @@
 
 #include <fstream>
 #include <list>
+#include <map>
+#include <boost/thread/mutex.hpp>
 #include "header.hpp"
 #include "dirtree.hpp"
+#include "geometry.hpp"
+#include "backend.hpp"
 
 namespace POLE
 {
@@ -41,6 +45,9 @@ namespace POLE
 template<typename _>
 class StreamImplT;
 
+template<typename _>
+class SidecarIndexT;
+
 template<typename _>
 class StorageIOT
 {
@@ -49,14 +56,21 @@ public:
 
 // Construction/destruction  
 public:
-	StorageIOT( const char* filename, std::ios_base::openmode mode, bool create);
+	// If directory_only is true only the header and the directory are loaded,
+	// the allocation tables are loaded when the first stream is opened. Files
+	// opened for reading up to slurp_limit bytes are read whole with a single
+	// read and served from memory.
+	StorageIOT( const char* filename, std::ios_base::openmode mode, bool create, bool directory_only = false, ULONG64 slurp_limit = 0 );
 	StorageIOT( std::iostream* stream );
+	// The backend is deleted with the storage if own is true.
+	StorageIOT( Backend* backend, bool own, bool directory_only = false );
     ~StorageIOT();
     
 // Attributes
 public:
 	int result() const { return _result; }
 	const Header* header() const { return _header; }
+	Backend* backend() const { return _backend; }
 	const DirEntry* entry(const std::string& path, bool create = false) const { return _dirtree->entry(path, create); }
 	void fullName( const DirEntry* entry, std::string& name) const { _dirtree->fullName( entry->index(), name); }
 	void current_path( std::string& result) const { _dirtree->current_path(result); }
@@ -65,6 +79,13 @@ public:
 	void listDirectory(std::list<std::string>&) const;
 	ULONG32 small_block_size() const { return (_sbat) ? _sbat->block_size() : 0; }
 	ULONG32 big_block_size() const { return (_bbat) ? _bbat->block_size() : 0; }
+	int geometry() const { return _geometry; }
+	// Approximate memory used by the parsed header, tables and directory.
+	ULONG64 memory() const
+	{
+		return sizeof(*this) + sizeof(Header) + _dirtree->entryCount() * sizeof(DirEntry) +
+			(_bbat->count() + _sbat->count() + _sb_blocks.size()) * sizeof(ULONG32);
+	}
 	void listEntries(std::vector<const DirEntry*>& result) const
 	{
 	  _dirtree->listDirectory(result);
@@ -75,21 +96,25 @@ public:
 	}
 	bool follow_small_block_table( ULONG32 start, std::vector<ULONG32>& chain ) const 
 	{ 
-		return (_sbat) ? _sbat->follow(start, chain) : false;
+		if (_indexed)
+			return follow_runs( _small_chains, start, chain );
+		return (_sbat && tables()) ? _sbat->follow(start, chain) : false;
 	}
 	bool follow_big_block_table( ULONG32 start, std::vector<ULONG32>& chain ) const 
 	{ 
-		return (_bbat) ? _bbat->follow(start, chain) : false;
+		if (_indexed)
+			return follow_runs( _big_chains, start, chain );
+		return (_bbat && tables()) ? _bbat->follow(start, chain) : false;
 	}
 
 	const std::vector<ULONG32>& sb_blocks() const { return _sb_blocks; }
 
-	void get_entry_childrens(size_t index, std::vector<size_t> result) const
+	void get_entry_childrens(ULONG32 index, std::vector<ULONG32> result) const
 	{
 		_dirtree->children(index, result);
 	}
 
-	void children( size_t index, std::vector<size_t>& result ) const
+	void children( ULONG32 index, std::vector<ULONG32>& result ) const
 	{
 		if (_dirtree)
 			_dirtree->children(index, result);
@@ -101,9 +126,11 @@ public:
 	bool enterDirectory( const std::string& directory ) { return _dirtree->enterDirectory( directory ); }
 	void leaveDirectory() { _dirtree->leaveDirectory(); }
 	std::streamsize loadSmallBlocks( const std::vector<ULONG32>& blocks, unsigned char* buffer, std::streamsize maxlen );
+	template<class Geometry>
+	std::streamsize loadSmallBlocks( const Geometry& g, const std::vector<ULONG32>& blocks, unsigned char* buffer, std::streamsize maxlen );
 	std::streamsize loadBigBlocks( const std::vector<ULONG32>& blocks, unsigned char* buffer, std::streamsize maxlen );
     std::streamsize loadBigBlock(ULONG32 block, unsigned char* buffer, std::streamsize maxlen);
-	std::streamsize saveBlock(ULONG32 block, const unsigned char* buffer, std::streamsize maxlen);
+	std::streamsize saveBlock(ULONG64 fisical_offset, const unsigned char* buffer, std::streamsize maxlen);
 	bool delete_entry(const std::string& path);
 	bool flush();
 	void notify_dirtree_changed() { m_dtmodified = true; }
@@ -117,11 +144,28 @@ private:
     void init();
     bool load();
     void close();
-
-    std::iostream* _stream;
-    std::fstream* _file;
-	ULONG32 _size;   // size of the storage stream
+	bool bat_blocks( std::vector<ULONG32>& blocks, size_t count );
+	bool load_big_table();
+	bool load_small_table();
+	bool follow_directory( std::vector<ULONG32>& chain );
+	// Loads the tables deferred by directory_only, returns false if they
+	// could not be loaded. result() is read without locking by the users of
+	// shared documents, so it keeps the result of the constructor, a failure
+	// is only recorded in _tables_loaded and the streams fail to open.
+	bool tables() const;
+	// Runs of consecutive blocks, first block and count.
+	typedef std::vector<std::pair<ULONG32, ULONG32> > Runs;
+	typedef std::map<ULONG32, Runs> Chains;
+	static bool follow_runs( const Chains& chains, ULONG32 start, std::vector<ULONG32>& chain );
+	// The backend of a document file. Files only read use pread on POSIX so
+	// the readahead of the streams reaches the kernel, see Backend::advise.
+	static Backend* open_file( const char* filename, std::ios_base::openmode mode );
+
+    Backend* _backend;  // where the document bytes are
+    bool _own_backend;
+	ULONG64 _size;   // size of the storage stream
     int _result;     // result of last operation
+	int _geometry;   // block sizes, selects the specialized code paths
     std::vector<ULONG32> _sb_blocks; // blocks for "small" files
 	
     Header* _header;           // storage header 
@@ -130,6 +174,17 @@ private:
     AllocTable* _sbat;         // allocation table for small blocks
 	bool m_dtmodified;
 
+	bool _deferred;       // the tables are not loaded yet
+	bool _tables_loaded;  // false if the deferred tables could not be loaded
+	boost::mutex* _tables_mutex; // directory_only only, guards the above
+
+	// Opened from a sidecar index, the chains of the streams, the directory
+	// and the mini stream replace the allocation tables, which are not loaded.
+	bool _indexed;
+	Chains _big_chains;   // by start block
+	Chains _small_chains; // by start block
+	friend class SidecarIndexT<_>;
+
 	// no copy or assign
     StorageIOT( const StorageIOT<_>& );
     StorageIOT<_>& operator=( const StorageIOT<_>& );
@@ -140,10 +195,27 @@ typedef StorageIOT<void> StorageIO;
 // =========== StorageIOT ==========
 
 template<typename _>
-StorageIOT<_>::StorageIOT( const char* filename, std::ios_base::openmode mode, bool create)
+StorageIOT<_>::StorageIOT( const char* filename, std::ios_base::openmode mode, bool create, bool directory_only, ULONG64 slurp_limit )
 {
 	m_dtmodified = false;
 	init();
+	_deferred = directory_only && !create;
+	if (_deferred)
+		_tables_mutex = new boost::mutex();
+
+	if (slurp_limit && !create && !(mode & std::ios_base::out))
+	{
+		BufferBackend* buffer = new BufferBackend( filename, slurp_limit );
+		if (buffer->good())
+		{
+			_result = OpenFailed;
+			_backend = buffer;
+			_own_backend = true;
+			load();
+			return;
+		}
+		delete buffer; // too large, read from the file
+	}
 
 	// open the file, check for error
 	_result = OpenFailed;
@@ -152,29 +224,54 @@ StorageIOT<_>::StorageIOT( const char* filename, std::ios_base::openmode mode, b
 		mode |= std::ios_base::out | std::ios_base::trunc; // make sure the file will be created if needed
 	else
 		mode &= ~std::ios_base::trunc; // make sure the file won't be created
-	std::fstream* file = new std::fstream( filename, std::ios::binary | mode);
-	if( !file)
-		return;
-	if (file->fail())
+	Backend* file = open_file( filename, mode );
+	if (!file->good())
 	{
 		delete file;
 		return;
 	}
-	_file = file;
-	_stream = file;
+	_backend = file;
+	_own_backend = true;
 	if (!create)
 		load();
 }
 
+template<typename _>
+Backend* StorageIOT<_>::open_file( const char* filename, std::ios_base::openmode mode )
+{
+#if !defined(_WIN32)
+	if (!(mode & std::ios_base::out))
+		return new PosixBackend( filename );
+#endif
+	return new FileBackend( filename, mode );
+}
+
 template<typename _>
 StorageIOT<_>::StorageIOT( std::iostream* stream )
 {
+	m_dtmodified = false;
 	init();
 	_result = OpenFailed;
-	_stream = stream;
+	_backend = new StreamBackend( stream );
+	_own_backend = true;
 	load();
 }
 
+template<typename _>
+StorageIOT<_>::StorageIOT( Backend* backend, bool own, bool directory_only )
+{
+	m_dtmodified = false;
+	init();
+	_deferred = directory_only;
+	if (_deferred)
+		_tables_mutex = new boost::mutex();
+	_result = OpenFailed;
+	_backend = backend;
+	_own_backend = own;
+	if (_backend && _backend->good())
+		load();
+}
+
 template<typename _>
 StorageIOT<_>::~StorageIOT()
 {
@@ -184,19 +281,25 @@ StorageIOT<_>::~StorageIOT()
 	if (_bbat) delete _bbat;
 	delete _dirtree;
 	delete _header;
+	delete _tables_mutex;
 }
 
 template<typename _>
 void StorageIOT<_>::init()
 {
 	_result = NewOLE;
-	_file = NULL;
-	_stream = NULL;
+	_backend = NULL;
+	_own_backend = false;
+	_indexed = false;
+	_deferred = false;
+	_tables_loaded = true;
+	_tables_mutex = NULL;
 
 	_header = new Header();
 	_dirtree = new DirTree();
 	_bbat = new AllocTable(1 << _header->b_shift());
 	_sbat = new AllocTable(1 << _header->s_shift());
+	_geometry = geometry_of(_header->b_shift(), _header->s_shift());
 
 	_size = 0;
 }
@@ -204,16 +307,15 @@ void StorageIOT<_>::init()
 template<typename _>
 bool StorageIOT<_>::load()
 {
-	if (!_stream) return false;
+	if (!_backend) return false;
 
 	// find size of input file
-	_stream->seekg( 0, std::ios::end );
-	_size = _stream->tellg();
-	_stream->seekg( 0 ); 
+	_size = _backend->size();
 
 	// load header
 	unsigned char buf_header[512];
-	_stream->read( (char*)buf_header, 512 );
+	if (_backend->read_at( 0, buf_header, 512 ) != 512)
+		return false;
 	bool res = _header->load( buf_header, 512 );
 	if (!res)
 		return false;
@@ -231,40 +333,89 @@ bool StorageIOT<_>::load()
 	// important block size
 	_bbat->set_block_size(1 << _header->b_shift());
 	_sbat->set_block_size(1 << _header->s_shift());
+	_geometry = geometry_of(_header->b_shift(), _header->s_shift());
 
-	// find blocks allocated to store big bat
-	// the first 109 blocks are in header, the rest in meta bat
+	// load directory tree
 	std::vector<ULONG32> blocks;
-	blocks.resize( _header->num_bat() );
-	for( unsigned i = 0; i < 109; i++ )
+	if (_deferred)
 	{
-		if( i >= _header->num_bat() ) 
-			break;
-		else 
-			blocks[i] = _header->bb_blocks()[i];
+		if (!follow_directory( blocks ))
+			return false;
 	}
-	if( (_header->num_bat() > 109) && (_header->num_mbat() > 0) )
+	else
 	{
-		unsigned char* buffer = new unsigned char[ _bbat->block_size() ];
-		if (!buffer)
+		if (!load_big_table())
 			return false;
-		unsigned k = 109;
-		for( unsigned r = 0; r < _header->num_mbat(); r++ )
-		{
-			size_t bytes = loadBigBlock(_header->mbat_start()+r+1, buffer, _bbat->block_size() );
-			if (bytes != _bbat->block_size())
-				break;
-			
-			for( unsigned s=0; s < _bbat->block_size(); s+=4 )
-			{
-				if( k >= _header->num_bat() ) 
-					break;
-				else  
-					blocks[k++] = readU32( buffer + s );
-			}  
-		}    
+		if (!_bbat->follow( _header->dirent_start(), blocks ))
+			return false;
+	}
+	std::streamsize buflen = _bbat->block_size()*(std::streamsize)blocks.size();
+	unsigned char* buffer = new unsigned char[ buflen ];  
+	if (!buffer)
+		return false;
+	loadBigBlocks( blocks, buffer, buflen );
+	if (!_dirtree->load( buffer, buflen, _header->major() >= 4 ))
+	{
 		delete[] buffer;
+		return false;
 	}
+	delete[] buffer;
+
+	// the tables are loaded when the first stream is opened, see tables()
+	if (!_deferred && !load_small_table())
+	{
+		_result = OpenSmallFatFailed;
+		return false;
+	}
+
+// for troubleshooting, just enable this block
+#if 0
+	debug();
+#endif
+
+	// so far so good
+	_result = Ok;
+	return true;
+}
+
+template<typename _>
+bool StorageIOT<_>::bat_blocks( std::vector<ULONG32>& blocks, size_t count )
+{
+	// the first 109 blocks are in header, the rest in meta bat
+	if (count > _header->num_bat())
+		count = _header->num_bat();
+	for (size_t i = blocks.size(); i < 109 && i < count; i++)
+		blocks.push_back( _header->bb_blocks()[i] );
+	if (blocks.size() >= count)
+		return true;
+
+	// the meta bat is read again from its start, only the blocks past the
+	// known ones are added
+	std::vector<unsigned char> buffer( _bbat->block_size() );
+	// the last entry of every meta bat block is the next meta bat block
+	unsigned last = _bbat->block_size() - 4;
+	size_t k = 109;
+	ULONG32 mblock = _header->mbat_start();
+	for (unsigned r = 0; r < _header->num_mbat() && k < count; r++)
+	{
+		size_t bytes = loadBigBlock( mblock+1, &buffer[0], _bbat->block_size() );
+		if (bytes != _bbat->block_size())
+			return false;
+		for (unsigned s = 0; s < last && k < count; s += 4, k++)
+			if (k >= blocks.size())
+				blocks.push_back( readU32( &buffer[s] ) );
+		mblock = readU32( &buffer[last] );
+	}
+	return blocks.size() >= count;
+}
+
+template<typename _>
+bool StorageIOT<_>::load_big_table()
+{
+	// find blocks allocated to store big bat
+	std::vector<ULONG32> blocks;
+	if (!bat_blocks( blocks, _header->num_bat() ))
+		return false;
 
 	// load big bat
 	std::streamsize buflen = _bbat->block_size()*(std::streamsize)blocks.size();
@@ -279,37 +430,27 @@ bool StorageIOT<_>::load()
 		if (!res)
 			return false;
 	}  
+	return true;
+}
 
-	// load directory tree
-	blocks.clear();
-	if (!_bbat->follow( _header->dirent_start(), blocks ))
-		return false;
-	buflen = _bbat->block_size()*(std::streamsize)blocks.size();
-	unsigned char* buffer = new unsigned char[ buflen ];  
-	if (!buffer)
-		return false;
-	loadBigBlocks( blocks, buffer, buflen );
-	if (!_dirtree->load( buffer, buflen ))
-	{
-		delete[] buffer;
+template<typename _>
+bool StorageIOT<_>::load_small_table()
+{
+	const DirEntry* root = _dirtree->root_entry();
+	if (!root)
 		return false;
-	}
-	unsigned sb_start = readU32( buffer + 0x74 );
-	delete[] buffer;
-		
-	_result = OpenSmallFatFailed;
 	// fetch block chain as data for small-files
-	if (!_bbat->follow( sb_start, _sb_blocks ))// small files
+	if (!_bbat->follow( root->start(), _sb_blocks ))// small files
 		return false;
 
 	// load small bat
-	blocks.clear();
+	std::vector<ULONG32> blocks;
 	if (!_bbat->follow( _header->sbat_start(), blocks ))
 		return false;
-	buflen = _bbat->block_size()*(std::streamsize)blocks.size();
+	std::streamsize buflen = _bbat->block_size()*(std::streamsize)blocks.size();
 	if( buflen > 0 )
 	{
-		buffer = new unsigned char[ buflen ];  
+		unsigned char* buffer = new unsigned char[ buflen ];  
 		if (!buffer)
 			return false;
 		loadBigBlocks( blocks, buffer, buflen );
@@ -318,36 +459,76 @@ bool StorageIOT<_>::load()
 		if (!res)
 			return false;
 	}  
+	return true;
+}
 
-// for troubleshooting, just enable this block
-#if 0
-	debug();
-#endif
+template<typename _>
+bool StorageIOT<_>::follow_directory( std::vector<ULONG32>& chain )
+{
+	// like AllocTable::follow, reading only the bat blocks the chain goes through
+	ULONG32 per_block = _bbat->block_size() / 4;
+	ULONG64 count = (ULONG64)_header->num_bat() * per_block;
+	ULONG32 p = _header->dirent_start();
+	if (p >= count)
+		return false;
 
-	// so far so good
-	_result = Ok;
+	std::vector<ULONG32> bat;
+	std::vector<unsigned char> buffer( _bbat->block_size() );
+	size_t loaded = (size_t)-1;
+	while (p < count)
+	{
+		if (chain.size() >= count)
+			return false; // a loop
+		chain.push_back( p );
+		size_t index = p / per_block;
+		if (index >= bat.size() && !bat_blocks( bat, index + 1 ))
+			return false;
+		if (index != loaded)
+		{
+			if (loadBigBlock( bat[index]+1, &buffer[0], _bbat->block_size() ) != (std::streamsize)_bbat->block_size())
+				return false;
+			loaded = index;
+		}
+		p = readU32( &buffer[(p % per_block) * 4] );
+	}
 	return true;
 }
 
+template<typename _>
+bool StorageIOT<_>::tables() const
+{
+	// the tables are always loaded unless opened directory_only
+	if (!_tables_mutex)
+		return _tables_loaded;
+	boost::mutex::scoped_lock lock( *_tables_mutex );
+	if (_deferred)
+	{
+		StorageIOT<_>* self = const_cast<StorageIOT<_>*>(this);
+		self->_deferred = false;
+		self->_tables_loaded = self->load_big_table() && self->load_small_table();
+	}
+	return _tables_loaded;
+}
+
 template<typename _>
 bool StorageIOT<_>::create( const char* filename )
 {
   // std::cout << "Creating " << filename << std::endl; 
   
-  std::fstream* file = new std::fstream(filename, std::ios::out|std::ios::binary);
-  if( !file || file->fail() )
+  FileBackend* file = new FileBackend(filename, std::ios::out);
+  if( !file->good() )
   {
     std::cerr << "Can't create " << filename << std::endl;
     _result = OpenFailed;
-	if (file)
-		delete file;
+	delete file;
     return false;
   }
   
   // so far so good
+  close();
   _result = Ok;
-  _file = file;
-  _stream = file;
+  _backend = file;
+  _own_backend = true;
   return true;
 }
 
@@ -355,21 +536,18 @@ template<typename _>
 void StorageIOT<_>::close()
 {
 	flush();
-	if (_file)
-	{
-		_file->close();
-		delete _file;
-		_file = NULL;
-	}
+	if (_own_backend)
+		delete _backend;
+	_backend = NULL;
+	_own_backend = false;
 }
 
 template<typename _>
 std::streamsize StorageIOT<_>::loadBigBlocks( const std::vector<ULONG32>& blocks, unsigned char* data, std::streamsize maxlen )
 {
   // sentinel
-  if( !_stream ) return 0; 
+  if( !_backend ) return 0; 
   if( !data ) return 0;
-  if( !_stream->good() ) return 0;
   if( maxlen == 0 ) return 0;
   size_t block_num = blocks.size();
   if( block_num < 1 ) return 0;
@@ -379,7 +557,7 @@ std::streamsize StorageIOT<_>::loadBigBlocks( const std::vector<ULONG32>& blocks
   for( ULONG32 i=0; (i < block_num ) && ( totalbytes < maxlen ); i++ )
   {
     ULONG32 block = blocks[i];
-    std::streamsize p = (_bbat->block_size() < (unsigned)(maxlen-totalbytes)) ? _bbat->block_size() : maxlen-totalbytes;
+    std::streamsize p = ((std::streamsize)_bbat->block_size() < maxlen-totalbytes) ? _bbat->block_size() : maxlen-totalbytes;
 	std::streamsize bytes = loadBigBlock(block+1, data+totalbytes, p );
     totalbytes += bytes;
   }
@@ -390,35 +568,46 @@ std::streamsize StorageIOT<_>::loadBigBlocks( const std::vector<ULONG32>& blocks
 template<typename _>
 std::streamsize StorageIOT<_>::loadBigBlock( ULONG32 block, unsigned char* data, std::streamsize maxlen )
 {
-	assert(_stream);
-	assert((unsigned)maxlen <= big_block_size());
+	assert(_backend);
+	assert(maxlen <= (std::streamsize)big_block_size());
 
-	ULONG32 block_pos = block * _bbat->block_size();
+	ULONG64 block_pos = (ULONG64)block << _header->b_shift();
 	if (block_pos > _size)
 		return 0;
 	if (block_pos + maxlen > _size)
-		maxlen = _size - block_pos;
-
-	_stream->seekg( block_pos );
-	_stream->read( (char*)data, (std::streamsize)maxlen );
+		maxlen = (std::streamsize)(_size - block_pos);
 
-	assert(!_stream->fail());
-	return _stream->gcount();
+	return _backend->read_at( block_pos, data, maxlen );
 }
 
 // return number of bytes which has been read
 template<typename _>
 std::streamsize StorageIOT<_>::loadSmallBlocks( const std::vector<ULONG32>& blocks, unsigned char* data, std::streamsize maxlen )
+{
+	switch (_geometry)
+	{
+	case Geometry512:
+		return loadSmallBlocks( FixedGeometry<9, 6>(), blocks, data, maxlen );
+	case Geometry4096:
+		return loadSmallBlocks( FixedGeometry<12, 6>(), blocks, data, maxlen );
+	default:
+		return loadSmallBlocks( DynamicGeometry(_header->b_shift(), _header->s_shift()), blocks, data, maxlen );
+	}
+}
+
+template<typename _>
+template<class Geometry>
+std::streamsize StorageIOT<_>::loadSmallBlocks( const Geometry& g, const std::vector<ULONG32>& blocks, unsigned char* data, std::streamsize maxlen )
 {
   // sentinel
   if( !data ) return 0;
-  if( !_stream || !_stream->good() ) return 0;
+  if( !_backend ) return 0;
   if( maxlen == 0 ) return 0;
   size_t block_num = blocks.size();
   if( block_num < 1 ) return 0;
 
   // our own local buffer
-  unsigned char* buf = new unsigned char[ _bbat->block_size() ];
+  unsigned char* buf = new unsigned char[ g.big_size() ];
   if (!buf) return 0;
 
   ULONG32 loaded_bblock = 0;
@@ -429,27 +618,27 @@ std::streamsize StorageIOT<_>::loadSmallBlocks( const std::vector<ULONG32>& bloc
   for( ULONG32 i=0; ( i<block_num ) && ( totalbytes<maxlen ); i++ )
   {
     // find where the small-block exactly is
-    ULONG32 pos = blocks[i] * _sbat->block_size();
-    ULONG32 bbindex = pos / _bbat->block_size();
+    ULONG64 pos = (ULONG64)blocks[i] << g.small_shift();
+    ULONG64 bbindex = pos >> g.big_shift();
     if( bbindex >= _sb_blocks.size() ) break;
 
-    ULONG32 bblock = _sb_blocks[ bbindex ] + 1;
+    ULONG32 bblock = _sb_blocks[ (size_t)bbindex ] + 1;
 	if (bblock != loaded_bblock || !bblock_loaded)
 	{
-		size_t read = loadBigBlock( bblock, buf, _bbat->block_size());
-		if (read != _bbat->block_size())
+		size_t read = loadBigBlock( bblock, buf, g.big_size());
+		if (read != g.big_size())
 			break;
 		bblock_loaded = true;
 		loaded_bblock = bblock;
 	}
 
     // copy the data
-    ULONG32 offset = pos % _bbat->block_size();
-	std::streamsize p = _sbat->block_size();
+    ULONG32 offset = (ULONG32)pos & g.big_mask();
+	std::streamsize p = g.small_size();
 	if (p > maxlen-totalbytes)
 		p = maxlen-totalbytes;
-	if ((unsigned)p > _bbat->block_size()-offset)
-		p = _bbat->block_size()-offset;
+	if (p > (std::streamsize)(g.big_size()-offset))
+		p = g.big_size()-offset;
     memcpy( data + totalbytes, buf + offset, p );
     totalbytes += p;
   }
@@ -471,13 +660,28 @@ void StorageIOT<_>::listDirectory(std::list<std::string>& result) const
 
 // Write a bigblock
 template<typename _>
-std::streamsize StorageIOT<_>::saveBlock(ULONG32 fisical_offset, const unsigned char* data, std::streamsize len)
+std::streamsize StorageIOT<_>::saveBlock(ULONG64 fisical_offset, const unsigned char* data, std::streamsize len)
 {
-	assert((unsigned)len <= big_block_size());
+	assert(len <= (std::streamsize)big_block_size());
 
-	_file->seekp(fisical_offset);
-	_file->write((const char*)data, (std::streamsize)len);
-	return len;
+	if (!_backend)
+		return 0;
+	return _backend->write_at(fisical_offset, data, len);
+}
+
+template<typename _>
+bool StorageIOT<_>::follow_runs( const Chains& chains, ULONG32 start, std::vector<ULONG32>& chain )
+{
+	if (start == AllocTable::Eof)
+		return true;
+	typename Chains::const_iterator it = chains.find( start );
+	if (it == chains.end())
+		return false;
+	const Runs& runs = it->second;
+	for (size_t i = 0; i < runs.size(); ++i)
+		for (ULONG32 k = 0; k < runs[i].second; ++k)
+			chain.push_back( runs[i].first + k );
+	return true;
 }
 
 template<typename _>
@@ -504,17 +708,16 @@ bool StorageIOT<_>::flush()
 	if (m_dtmodified && _bbat && _header)
 	{
 		std::vector<ULONG32> blocks;
-		if (!_bbat->follow( _header->dirent_start(), blocks ))
+		if (!follow_big_block_table( _header->dirent_start(), blocks ))
 			return false;
 		size_t bufflen = blocks.size() * _bbat->block_size();
-		unsigned char *buffer = new unsigned char[bufflen];
-		if (!_dirtree->save(buffer, bufflen))
+		std::vector<unsigned char> buffer(bufflen);
+		if (!_dirtree->save(&buffer[0], bufflen))
 			return false;
 		for (ULONG32 ndx = 0; ndx < blocks.size(); ++ndx)
 		{
-			ULONG32 fisical_offset = (blocks[ndx] * big_block_size()) + big_block_size();
-			saveBlock(fisical_offset, buffer, big_block_size());
-			buffer += big_block_size();
+			ULONG64 fisical_offset = ((ULONG64)blocks[ndx] + 1) * big_block_size();
+			saveBlock(fisical_offset, &buffer[ndx * big_block_size()], big_block_size());
 		}
 		m_dtmodified = false;
 	}
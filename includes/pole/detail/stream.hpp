@@ -30,11 +30,40 @@
 // storage header
 #pragma once
 
+#include <algorithm>
+#include <boost/function.hpp>
 #include "storage.hpp"
 
 namespace POLE
 {
 
+// One part of a scattered read, see StreamImpl::readv.
+struct ReadRequest
+{
+	ReadRequest(): offset(0), length(0), data(NULL), read(0) {}
+	ReadRequest( ULONG64 offset_, std::streamsize length_, unsigned char* data_ ): offset(offset_), length(length_), data(data_), read(0) {}
+
+	ULONG64 offset;          // position in the stream
+	std::streamsize length;  // bytes to read
+	unsigned char* data;     // destination
+	std::streamsize read;    // bytes actually read, set by readv
+};
+
+// A run of stream bytes stored contiguously in the document.
+struct Extent
+{
+	ULONG64 offset;   // position in the document
+	ULONG64 position; // position in the stream
+	ULONG64 length;
+	size_t stream;    // index of the stream, see Storage::sweep
+	bool operator<( const Extent& other ) const { return offset < other.offset; }
+};
+
+// Receives the stream bytes read by Storage::sweep: the index of the stream,
+// the position of the data in the stream and the data, valid only during the
+// call. Must return false to abort.
+typedef boost::function<bool (size_t stream, ULONG64 pos, const unsigned char* data, std::streamsize len)> SweepHandler;
+
 template<typename _>
 class StreamImplT
 {
@@ -82,6 +111,34 @@ public:
 
     int getch();
     std::streamsize read( unsigned char* data, std::streamsize maxlen );
+	// Reads at pos without moving the read pointer or changing the state.
+	// read_at and readv may be called from several threads at the same time,
+	// as long as nobody writes to the document.
+	std::streamsize read_at( std::streampos pos, unsigned char* data, std::streamsize maxlen ) const;
+	// Performs many reads at once. The requests are split in blocks, sorted by
+	// their position in the document and blocks that follow each other are
+	// read together. Returns the total number of bytes read.
+	std::streamsize readv( std::vector<ReadRequest>& requests ) const;
+	// When the document is in memory, returns the address of the data at pos
+	// in the backend and sets len to the number of bytes, up to maxlen, stored
+	// contiguously from there. Nothing is copied. Returns NULL if the backend
+	// is not in memory or pos is past the end.
+	const unsigned char* span( std::streampos pos, std::streamsize maxlen, std::streamsize& len ) const;
+	// Like span at the read pointer, which is moved past the returned bytes.
+	const unsigned char* read_span( std::streamsize maxlen, std::streamsize& len );
+	// Appends where the stream is stored in the document, in stream order.
+	// Blocks that follow each other are merged. Returns false if the block
+	// chain is shorter than the stream.
+	bool extents( std::vector<Extent>& result, size_t stream ) const;
+#if !defined(_WIN32)
+	// Copies len bytes at pos to the file descriptor fd at out_pos, like
+	// read_at. The runs of big blocks are copied by the backend when it can,
+	// see Backend::copy_to, the rest goes through a buffer. Returns the
+	// number of bytes copied. The buffer is allocated for the call, up to
+	// 1 MB, unless one is given: it is then grown up to len bytes and may be
+	// reused by the caller.
+	std::streamsize copy_to( int fd, std::streampos pos, std::streamsize len, ULONG64 out_pos, std::vector<unsigned char>* buffer = NULL ) const;
+#endif
 	std::streamsize write(const unsigned char* data, std::streamsize maxlen);
 	bool reserve(std::streamsize size);
 	bool resize(std::streamsize size, char val);
@@ -90,7 +147,13 @@ public:
 private:
 	void init();
 	std::streamsize read( std::streampos pos, unsigned char* data, std::streamsize maxlen );
+	template<class Geometry>
+	std::streamsize read_at( const Geometry& g, std::streampos pos, unsigned char* data, std::streamsize maxlen ) const;
+	template<class Geometry>
+	std::streamsize write( const Geometry& g, const unsigned char* data, std::streamsize maxlen );
 	void update_cache();
+	void readahead( std::streampos pos, std::streamsize len );
+	bool physical( ULONG64 pos, ULONG64& offset, std::streamsize& run ) const;
 
 	StorageIO* _io; 
     const DirEntry* _entry; 
@@ -104,6 +167,12 @@ private:
     std::streampos _cache_pos;
 	int _state;
 
+	// sequential read detection, see readahead()
+	enum { ReadAheadMin = 128 * 1024, ReadAheadMax = 4 * 1024 * 1024 };
+	std::streampos _ra_next;    // where the next sequential read starts
+	ULONG64 _ra_end;            // stream bytes already hinted to the backend
+	std::streamsize _ra_window; // bytes to hint past a read, 0 for random access
+
     // no default, copy or assign
     StreamImplT( );
     StreamImplT<_>& operator=( const StreamImplT<_>& );
@@ -131,6 +200,10 @@ StreamImplT<_>::StreamImplT( const StreamImplT<_>& stream)
 	_cache_data = new unsigned char[4096];
 	for (std::streamsize i = 0; i<_cache_size; i++)
 		_cache_data[i] = stream._cache_data[i];
+
+	_ra_next = stream._ra_next;
+	_ra_end = stream._ra_end;
+	_ra_window = stream._ra_window;
 }
 
 template<typename _>
@@ -143,6 +216,9 @@ void StreamImplT<_>::init()
   _cache_pos = 0;
   _cache_size = 4096; // optimal ?
   _cache_data = new unsigned char[_cache_size];
+  _ra_next = 0;
+  _ra_end = 0;
+  _ra_window = 0;
 
   // sanity check
   if (!_entry) 
@@ -169,7 +245,7 @@ void StreamImplT<_>::seekg( std::streampos pos, std::ios_base::seekdir origin)
 	switch (origin)
 	{
 	case std::ios_base::beg:
-		if ((unsigned)pos > _entry->size())
+		if ((ULONG64)(std::streamoff)pos > _entry->size())
 		{
 			_state |= StreamImpl::Eof;
 			_gpos = _entry->size();
@@ -182,7 +258,7 @@ void StreamImplT<_>::seekg( std::streampos pos, std::ios_base::seekdir origin)
 		_gpos = pos;
 		break;
 	case std::ios_base::cur:
-		if ((unsigned)(_gpos + pos) > _entry->size())
+		if ((ULONG64)(std::streamoff)(_gpos + pos) > _entry->size())
 		{
 			_state |= StreamImpl::Eof;
 			_gpos = _entry->size();
@@ -195,7 +271,7 @@ void StreamImplT<_>::seekg( std::streampos pos, std::ios_base::seekdir origin)
 		_gpos += pos;
 		break;
 	case std::ios_base::end:
-		if ((unsigned)pos > _entry->size())
+		if ((ULONG64)(std::streamoff)pos > _entry->size())
 		{
 			_state |= StreamImpl::Eof;
 			_gpos = 0;
@@ -216,7 +292,7 @@ void StreamImplT<_>::seekp( std::streampos pos, std::ios_base::seekdir origin)
 	switch (origin)
 	{
 	case std::ios_base::beg:
-		if ((unsigned)pos > _entry->size())
+		if ((ULONG64)(std::streamoff)pos > _entry->size())
 		{
 			_state |= StreamImpl::Eof;
 			_ppos = _entry->size();
@@ -229,7 +305,7 @@ void StreamImplT<_>::seekp( std::streampos pos, std::ios_base::seekdir origin)
 		_ppos = pos;
 		break;
 	case std::ios_base::cur:
-		if ((unsigned)(_ppos + pos) > _entry->size())
+		if ((ULONG64)(std::streamoff)(_ppos + pos) > _entry->size())
 		{
 			_state |= StreamImpl::Eof;
 			_ppos = _entry->size();
@@ -242,7 +318,7 @@ void StreamImplT<_>::seekp( std::streampos pos, std::ios_base::seekdir origin)
 		_ppos += pos;
 		break;
 	case std::ios_base::end:
-		if ((unsigned)pos > _entry->size())
+		if ((ULONG64)(std::streamoff)pos > _entry->size())
 		{
 			_state |= StreamImpl::Eof;
 			_ppos = 0;
@@ -270,7 +346,7 @@ int StreamImplT<_>::getch()
 
   // need to update cache ?
   if( !_cache_size || ( _gpos < _cache_pos ) ||
-    ( (unsigned)_gpos >= (unsigned)_cache_pos + _cache_size ) )
+    ( _gpos >= _cache_pos + _cache_size ) )
       update_cache();
 
   // something bad if we don't get good cache
@@ -285,22 +361,44 @@ int StreamImplT<_>::getch()
 
 template<typename _>
 std::streamsize StreamImplT<_>::read( std::streampos pos, unsigned char* data, std::streamsize maxlen )
+{
+	if (_entry && (ULONG64)(std::streamoff)(pos + maxlen) > _entry->size())
+		_state |= StreamImpl::Eof;
+	else
+		_state &= ~StreamImpl::Eof;
+	return read_at( pos, data, maxlen );
+}
+
+template<typename _>
+std::streamsize StreamImplT<_>::read_at( std::streampos pos, unsigned char* data, std::streamsize maxlen ) const
+{
+	switch (_io->geometry())
+	{
+	case Geometry512:
+		return read_at( FixedGeometry<9, 6>(), pos, data, maxlen );
+	case Geometry4096:
+		return read_at( FixedGeometry<12, 6>(), pos, data, maxlen );
+	default:
+		return read_at( DynamicGeometry(_io->header()->b_shift(), _io->header()->s_shift()), pos, data, maxlen );
+	}
+}
+
+// Positions are computed with the shifts and masks of the geometry, the block
+// sizes are always powers of two.
+template<typename _>
+template<class Geometry>
+std::streamsize StreamImplT<_>::read_at( const Geometry& g, std::streampos pos, unsigned char* data, std::streamsize maxlen ) const
 {
   // sanity checks
   if (!_entry) 
 	  return 0;
   if( !data ) 
 	  return 0;
-  if ((maxlen + (unsigned)pos) > _entry->size())
-  {
-	  maxlen = _entry->size() - pos;
-	  _state |= StreamImpl::Eof;
-  }
-  else
-  {
-	  _state &= ~StreamImpl::Eof;
-  }
-  if( maxlen == 0 ) 
+  if( pos < 0 || (ULONG64)(std::streamoff)pos >= _entry->size() )
+	  return 0;
+  if ((ULONG64)(std::streamoff)(maxlen + pos) > _entry->size())
+	  maxlen = (std::streamsize)(_entry->size() - (std::streamoff)pos);
+  if( maxlen <= 0 ) 
 	  return 0;
 
   std::streamsize totalbytes = 0;
@@ -309,7 +407,7 @@ std::streamsize StreamImplT<_>::read( std::streampos pos, unsigned char* data, s
   if ( _entry->size() < _io->header()->threshold() )
   {
     // small file
-    std::streamsize index = pos / _io->small_block_size();
+    std::streamsize index = (std::streamsize)(std::streamoff)pos >> g.small_shift();
     if( index >= max_block_num ) 
 		return 0;
 
@@ -318,22 +416,22 @@ std::streamsize StreamImplT<_>::read( std::streampos pos, unsigned char* data, s
 	// time. If we don't do this the same big block may be loaded
 	// several times.
 
-	unsigned char* buf = new unsigned char[ _io->big_block_size() ];
+	unsigned char* buf = new unsigned char[ g.big_size() ];
 	if (!buf)
 		return 0;
-	std::streamsize max_blocks_to_read = maxlen / _io->small_block_size();
-	if (maxlen % _io->small_block_size())
+	std::streamsize max_blocks_to_read = maxlen >> g.small_shift();
+	if (maxlen & g.small_mask())
 		max_blocks_to_read++;
-    std::streamsize small_blocks_in_big_blocks = _io->big_block_size() / _io->small_block_size();
+    std::streamsize small_blocks_in_big_blocks = (std::streamsize)1 << (g.big_shift() - g.small_shift());
 	std::vector<ULONG32> blocks;
 	blocks.reserve(small_blocks_in_big_blocks);
 
 	// Read the small blocks that start not at the beginning of the
 	// big block.
 	std::streamsize read_blocks = 0;
-	std::streamsize offset = pos % _io->small_block_size();
-	std::streamsize unaligned_blocks = small_blocks_in_big_blocks - index % small_blocks_in_big_blocks;
-	unaligned_blocks %= small_blocks_in_big_blocks;
+	std::streamsize offset = (std::streamsize)(std::streamoff)pos & g.small_mask();
+	std::streamsize unaligned_blocks = small_blocks_in_big_blocks - (index & (small_blocks_in_big_blocks - 1));
+	unaligned_blocks &= small_blocks_in_big_blocks - 1;
 	std::streamsize j = 0;
     if (unaligned_blocks)
 	{
@@ -343,8 +441,8 @@ std::streamsize StreamImplT<_>::read( std::streampos pos, unsigned char* data, s
 			else
 				break;
 		index += j;
-		std::streamsize bytes = j * _io->small_block_size();
-		std::streamsize read = _io->loadSmallBlocks( blocks, buf, bytes );
+		std::streamsize bytes = j << g.small_shift();
+		std::streamsize read = _io->loadSmallBlocks( g, blocks, buf, bytes );
 		if (read != bytes)
 		{
 			memcpy(data, buf + offset, read);
@@ -367,7 +465,7 @@ std::streamsize StreamImplT<_>::read( std::streampos pos, unsigned char* data, s
 
 	// Read the remaining small blocks. These start at the beginning of a 
 	// big block.
-	size_t max_bblocks = max_blocks_to_read / small_blocks_in_big_blocks + 1;
+	size_t max_bblocks = (size_t)(max_blocks_to_read >> (g.big_shift() - g.small_shift())) + 1;
     for (size_t i = 0; i<max_bblocks && totalbytes < maxlen; ++i)
 	{
 		j = 0;
@@ -378,8 +476,8 @@ std::streamsize StreamImplT<_>::read( std::streampos pos, unsigned char* data, s
 			else
 				break;
 		index += j;
-		std::streamsize bytes = j * _io->small_block_size();
-		std::streamsize read = _io->loadSmallBlocks( blocks, buf, bytes );
+		std::streamsize bytes = j << g.small_shift();
+		std::streamsize read = _io->loadSmallBlocks( g, blocks, buf, bytes );
 		read_blocks += j;
 		std::streamsize count = read - offset;
 		if(count > maxlen-totalbytes) 
@@ -395,22 +493,31 @@ std::streamsize StreamImplT<_>::read( std::streampos pos, unsigned char* data, s
   }
 
   // big file
-  std::streamsize index = pos / _io->big_block_size();
+  std::streamsize index = (std::streamsize)(std::streamoff)pos >> g.big_shift();
     
   if( index >= max_block_num ) 
 	return 0;
     
-  unsigned char* buf = new unsigned char[ _io->big_block_size() ];
-  size_t offset = pos % _io->big_block_size();
+  unsigned char* buf = new unsigned char[ g.big_size() ];
+  size_t offset = (size_t)(std::streamoff)pos & g.big_mask();
   for (; index < max_block_num && totalbytes < maxlen; ++index )
   {
     ULONG32 block = _blocks[index];
-	size_t read = _io->loadBigBlock(block+1, buf, _io->big_block_size());
-    if (read != _io->big_block_size())
- 	  break;
-    std::streamsize count = _io->big_block_size() - offset;
+    std::streamsize count = g.big_size() - offset;
     if( count > maxlen-totalbytes ) count = maxlen-totalbytes;
-    memcpy( data+totalbytes, buf + offset, count );
+	if (count == (std::streamsize)g.big_size())
+	{
+		// whole blocks go straight to the caller
+		if (_io->loadBigBlock(block+1, data+totalbytes, count) != count)
+			break;
+	}
+	else
+	{
+		size_t read = _io->loadBigBlock(block+1, buf, g.big_size());
+		if (read != g.big_size())
+			break;
+		memcpy( data+totalbytes, buf + offset, count );
+	}
     totalbytes += count;
     offset = 0;
   }
@@ -422,15 +529,266 @@ std::streamsize StreamImplT<_>::read( std::streampos pos, unsigned char* data, s
 template<typename _>
 std::streamsize StreamImplT<_>::read( unsigned char* data, std::streamsize maxlen )
 {
+  readahead( tellg(), maxlen );
   std::streamsize bytes = read( tellg(), data, maxlen );
   _gpos += bytes;
 
-  if ((unsigned)_gpos == _entry->size())
+  if ((ULONG64)(std::streamoff)_gpos == _entry->size())
 	  _state |= StreamImpl::Eof;
 
   return bytes;
 }
 
+// Finds where the stream byte at pos is in the document and how many bytes
+// of its block follow it.
+template<typename _>
+bool StreamImplT<_>::physical( ULONG64 pos, ULONG64& offset, std::streamsize& run ) const
+{
+	const Header* header = _io->header();
+	unsigned b_shift = header->b_shift();
+	ULONG32 b_mask = (1 << b_shift) - 1;
+	if (_entry->size() >= header->threshold())
+	{
+		ULONG64 index = pos >> b_shift;
+		if (index >= _blocks.size())
+			return false;
+		offset = (((ULONG64)_blocks[(size_t)index] + 1) << b_shift) + ((ULONG32)pos & b_mask);
+		run = (std::streamsize)(b_mask + 1 - ((ULONG32)pos & b_mask));
+		return true;
+	}
+
+	// small blocks are inside the big blocks of the mini stream
+	unsigned s_shift = header->s_shift();
+	ULONG32 s_mask = (1 << s_shift) - 1;
+	ULONG64 index = pos >> s_shift;
+	if (index >= _blocks.size())
+		return false;
+	ULONG64 mini = ((ULONG64)_blocks[(size_t)index] << s_shift) + ((ULONG32)pos & s_mask);
+	const std::vector<ULONG32>& sb_blocks = _io->sb_blocks();
+	ULONG64 bbindex = mini >> b_shift;
+	if (bbindex >= sb_blocks.size())
+		return false;
+	offset = (((ULONG64)sb_blocks[(size_t)bbindex] + 1) << b_shift) + ((ULONG32)mini & b_mask);
+	run = (std::streamsize)(s_mask + 1 - ((ULONG32)pos & s_mask));
+	return true;
+}
+
+template<typename _>
+const unsigned char* StreamImplT<_>::span( std::streampos pos, std::streamsize maxlen, std::streamsize& len ) const
+{
+	len = 0;
+	const unsigned char* base = (_io->backend()) ? _io->backend()->data() : NULL;
+	ULONG64 start = (ULONG64)(std::streamoff)pos;
+	if (!_entry || !base || fail() || maxlen <= 0 || start >= _entry->size())
+		return NULL;
+	if ((ULONG64)maxlen > _entry->size() - start)
+		maxlen = (std::streamsize)(_entry->size() - start);
+
+	ULONG64 offset;
+	std::streamsize run;
+	if (!physical( start, offset, run ))
+		return NULL;
+
+	// extend the span while the next blocks follow in the document
+	len = run;
+	ULONG64 next;
+	while (len < maxlen && physical( start + len, next, run ) && next == offset + len)
+		len += run;
+	if (len > maxlen)
+		len = maxlen;
+
+	// a truncated document
+	ULONG64 size = _io->backend()->size();
+	if (offset >= size)
+	{
+		len = 0;
+		return NULL;
+	}
+	if ((ULONG64)len > size - offset)
+		len = (std::streamsize)(size - offset);
+	return base + offset;
+}
+
+// A part of a request that is stored contiguously in the document
+struct ReadPiece
+{
+	ULONG64 offset;        // position in the document
+	std::streamsize length;
+	unsigned char* data;
+	size_t request;
+	bool operator<( const ReadPiece& other ) const { return offset < other.offset; }
+};
+
+template<typename _>
+std::streamsize StreamImplT<_>::readv( std::vector<ReadRequest>& requests ) const
+{
+	// larger merges of unrelated destinations would need too much memory
+	const std::streamsize max_merge = 1 << 20;
+
+	Backend* backend = _io->backend();
+	std::vector<ReadPiece> pieces;
+	for (size_t i = 0; i < requests.size(); ++i)
+	{
+		ReadRequest& r = requests[i];
+		r.read = 0;
+		if (!_entry || !backend || !r.data || r.length <= 0 || r.offset >= _entry->size())
+			continue;
+		std::streamsize length = r.length;
+		if ((ULONG64)length > _entry->size() - r.offset)
+			length = (std::streamsize)(_entry->size() - r.offset);
+
+		// one piece per block, joined while the blocks follow each other
+		std::streamsize done = 0;
+		while (done < length)
+		{
+			ReadPiece piece;
+			std::streamsize run;
+			if (!physical( r.offset + done, piece.offset, run ))
+				break;
+			piece.length = (run < length - done) ? run : length - done;
+			piece.data = r.data + done;
+			piece.request = i;
+			ReadPiece* last = pieces.empty() ? NULL : &pieces.back();
+			if (last && last->request == i && last->offset + last->length == piece.offset)
+				last->length += piece.length;
+			else
+				pieces.push_back( piece );
+			done += piece.length;
+		}
+	}
+	std::sort( pieces.begin(), pieces.end() );
+
+	std::streamsize total = 0;
+	std::vector<unsigned char> buffer;
+	for (size_t i = 0; i < pieces.size(); )
+	{
+		// pieces following each other in the document are read at once, 
+		// straight to the destination if it is contiguous too
+		size_t j = i + 1;
+		std::streamsize length = pieces[i].length;
+		bool direct = true;
+		for (; j < pieces.size() && pieces[j].offset == pieces[i].offset + length; ++j)
+		{
+			bool next_direct = direct && pieces[j].data == pieces[j-1].data + pieces[j-1].length;
+			if (!next_direct && length + pieces[j].length > max_merge)
+				break;
+			direct = next_direct;
+			length += pieces[j].length;
+		}
+
+		std::streamsize read;
+		if (direct)
+			read = backend->read_at( pieces[i].offset, pieces[i].data, length );
+		else
+		{
+			buffer.resize( (size_t)length );
+			read = backend->read_at( pieces[i].offset, &buffer[0], length );
+		}
+
+		std::streamsize pos = 0;
+		for (; i < j; ++i)
+		{
+			std::streamsize count = (read - pos < pieces[i].length) ? read - pos : pieces[i].length;
+			if (count <= 0)
+				continue;
+			if (!direct)
+				memcpy( pieces[i].data, &buffer[(size_t)pos], (size_t)count );
+			requests[pieces[i].request].read += count;
+			pos += pieces[i].length;
+			total += count;
+		}
+	}
+	return total;
+}
+
+template<typename _>
+const unsigned char* StreamImplT<_>::read_span( std::streamsize maxlen, std::streamsize& len )
+{
+	const unsigned char* data = span( _gpos, maxlen, len );
+	_gpos += len;
+	if ((ULONG64)(std::streamoff)_gpos == _entry->size())
+		_state |= StreamImpl::Eof;
+	return data;
+}
+
+template<typename _>
+bool StreamImplT<_>::extents( std::vector<Extent>& result, size_t stream ) const
+{
+	if (!_entry || fail())
+		return false;
+	ULONG64 pos = 0;
+	while (pos < _entry->size())
+	{
+		Extent e;
+		std::streamsize run;
+		if (!physical( pos, e.offset, run ))
+			return false;
+		e.position = pos;
+		e.length = run;
+		if ((ULONG64)run > _entry->size() - pos)
+			e.length = _entry->size() - pos;
+		e.stream = stream;
+		Extent* last = result.empty() ? NULL : &result.back();
+		if (last && last->stream == stream && last->offset + last->length == e.offset)
+			last->length += e.length;
+		else
+			result.push_back( e );
+		pos += e.length;
+	}
+	return true;
+}
+
+#if !defined(_WIN32)
+template<typename _>
+std::streamsize StreamImplT<_>::copy_to( int fd, std::streampos pos, std::streamsize len, ULONG64 out_pos, std::vector<unsigned char>* buffer ) const
+{
+	ULONG64 start = (ULONG64)(std::streamoff)pos;
+	if (!_entry || fail() || fd < 0 || len <= 0 || start >= _entry->size())
+		return 0;
+	if ((ULONG64)len > _entry->size() - start)
+		len = (std::streamsize)(_entry->size() - start);
+
+	// the backend copies whole runs of big blocks, small blocks are too short
+	std::streamsize total = 0;
+	std::vector<Extent> runs;
+	if (_entry->size() >= _io->header()->threshold() && extents( runs, 0 ))
+	{
+		for (size_t i = 0; i < runs.size() && total < len; ++i)
+		{
+			const Extent& e = runs[i];
+			if (e.position + e.length <= start + total)
+				continue;
+			ULONG64 skip = start + total - e.position;
+			std::streamsize count = (e.length - skip < (ULONG64)(len - total)) ? (std::streamsize)(e.length - skip) : len - total;
+			std::streamsize copied = _io->backend()->copy_to( e.offset + skip, count, fd, out_pos + total );
+			total += copied;
+			if (copied < count)
+				break;
+		}
+	}
+
+	// anything left through a buffer
+	PosixBackend out( fd, false );
+	std::vector<unsigned char> local;
+	std::vector<unsigned char>& data = buffer ? *buffer : local;
+	std::streamsize limit = buffer ? len : (1 << 20);
+	while (total < len)
+	{
+		std::streamsize count = (len - total < limit) ? len - total : limit;
+		if (data.size() < (size_t)count)
+			data.resize( (size_t)count );
+		std::streamsize read = read_at( start + total, &data[0], count );
+		if (read <= 0)
+			break;
+		std::streamsize written = out.write_at( out_pos + total, &data[0], read );
+		total += written;
+		if (written < read)
+			break;
+	}
+	return total;
+}
+#endif
+
 template<typename _>
 void StreamImplT<_>::update_cache()
 {
@@ -442,11 +800,66 @@ void StreamImplT<_>::update_cache()
 
   _cache_pos = _gpos - ( _gpos % _cache_size );
   std::streamsize bytes = _cache_size;
-  if( (unsigned)_cache_pos + bytes > _entry->size() ) 
+  if( (ULONG64)(_cache_pos + bytes) > _entry->size() ) 
 	  bytes = _entry->size() - _cache_pos;
+  readahead( _cache_pos, bytes );
   _cache_size = read( _cache_pos, _cache_data, bytes );
 }
 
+// Reads that start where the previous one ended open a window of stream
+// bytes past them, doubled on every sequential read up to ReadAheadMax. The
+// blocks in the window are hinted to the backend, which may load them while
+// the caller processes the data. Any other read closes the window.
+template<typename _>
+void StreamImplT<_>::readahead( std::streampos pos, std::streamsize len )
+{
+	if (!_entry || !_io->backend() || len <= 0)
+		return;
+	if (pos != _ra_next)
+	{
+		// random access, plain reads
+		_ra_window = 0;
+		_ra_end = 0;
+	}
+	else if (_ra_window == 0)
+		_ra_window = ReadAheadMin;
+	else if (_ra_window < ReadAheadMax)
+		_ra_window *= 2;
+	_ra_next = pos + len;
+
+	// small streams are read at once
+	if (!_ra_window || _entry->size() < _io->header()->threshold())
+		return;
+	ULONG64 end = (ULONG64)(std::streamoff)pos + len + _ra_window;
+	if (end > _entry->size())
+		end = _entry->size();
+	// hint in batches of half a window
+	if (end < _ra_end + _ra_window / 2 && end < _entry->size())
+		return;
+	ULONG64 from = (ULONG64)(std::streamoff)pos;
+	if (from < _ra_end)
+		from = _ra_end;
+	_ra_end = end;
+
+	// one hint for every run of blocks that follow each other in the document
+	ULONG64 start = 0, length = 0, offset;
+	std::streamsize run;
+	for (; from < end && physical( from, offset, run ); from += run)
+	{
+		if (length && offset == start + length)
+			length += run;
+		else
+		{
+			if (length)
+				_io->backend()->advise( start, length );
+			start = offset;
+			length = run;
+		}
+	}
+	if (length)
+		_io->backend()->advise( start, length );
+}
+
 /*
 para escribir:
 1. El entry de cada stream contiene el bloque en que comienza, hay que cargarlos todos en un vector utilizando el follow de la clase AllocTable.
@@ -459,13 +872,28 @@ para escribir:
 */
 template<typename _>
 std::streamsize StreamImplT<_>::write(const unsigned char* data, std::streamsize maxlen)
+{
+	switch (_io->geometry())
+	{
+	case Geometry512:
+		return write( FixedGeometry<9, 6>(), data, maxlen );
+	case Geometry4096:
+		return write( FixedGeometry<12, 6>(), data, maxlen );
+	default:
+		return write( DynamicGeometry(_io->header()->b_shift(), _io->header()->s_shift()), data, maxlen );
+	}
+}
+
+template<typename _>
+template<class Geometry>
+std::streamsize StreamImplT<_>::write(const Geometry& g, const unsigned char* data, std::streamsize maxlen)
 {
 	// Sanity checks
 	if(! _entry) 
 		return 0;
 	if(!data) 
 		return 0;
-	if((maxlen + (unsigned)_ppos) > _entry->size())
+	if((ULONG64)(maxlen + _ppos) > _entry->size())
 	{
 		maxlen = _entry->size() - _ppos;
 		_state |= StreamImpl::Eof;
@@ -487,27 +915,26 @@ std::streamsize StreamImplT<_>::write(const unsigned char* data, std::streamsize
 	if (_entry->size() < _io->header()->threshold())
 	{
 		// small file
-		size_t index = _ppos / _io->small_block_size();
+		size_t index = (size_t)((std::streamoff)_ppos >> g.small_shift());
 	    if( index >= max_block_num ) 
 			return 0;
 		
-		size_t offset = _ppos % _io->small_block_size();
-		std::vector<ULONG32> _sbroot_entry = _io->sb_blocks();
+		size_t offset = (size_t)(std::streamoff)_ppos & g.small_mask();
+		const std::vector<ULONG32>& _sbroot_entry = _io->sb_blocks();
 		for (; index < max_block_num && count < maxlen; ++index)
 		{
 			// Take the minifat sector index
 			ULONG32 minifat_index = _blocks[index];
-			ULONG32 sbindex_offset = minifat_index % 8;
 			// Calculate the the root entry's big block index
-			ULONG32 position = minifat_index * _io->small_block_size();
-			ULONG32 bbindex = position / _io->big_block_size();
+			ULONG64 position = (ULONG64)minifat_index << g.small_shift();
+			ULONG64 bbindex = position >> g.big_shift();
 			// Fisical offset inside the file
-			ULONG32 bbindice = _sbroot_entry[bbindex];
-			ULONG32 fisical_offset = (((bbindice * _io->big_block_size()) + _io->big_block_size()) + 
-								     (sbindex_offset * _io->small_block_size())) + offset;
+			ULONG64 bbindice = _sbroot_entry[(size_t)bbindex];
+			ULONG64 fisical_offset = ((bbindice + 1) << g.big_shift()) + 
+								     ((ULONG32)position & g.big_mask()) + offset;
 
 			// Amount of bytes that can actually be written
-			std::streamsize canwrite = _io->small_block_size() - offset;
+			std::streamsize canwrite = g.small_size() - offset;
 			if (canwrite > data_len )
 				canwrite = data_len;
 
@@ -527,20 +954,20 @@ std::streamsize StreamImplT<_>::write(const unsigned char* data, std::streamsize
 	{
 		// big file
 		// Ordinal of the first block for writing
-		size_t index = _ppos / _io->big_block_size();
+		size_t index = (size_t)((std::streamoff)_ppos >> g.big_shift());
 		if(index >= max_block_num) 
 			return 0;
 		
 		// Offset inside this block
-		size_t offset = _ppos % _io->big_block_size();
+		size_t offset = (size_t)(std::streamoff)_ppos & g.big_mask();
 
 		for (; index < max_block_num && count < maxlen; ++index)
 		{
 			// Fisical offset inside the file
-			ULONG32 fisical_offset = ((_blocks[index] * _io->big_block_size()) + _io->big_block_size() + offset);
+			ULONG64 fisical_offset = (((ULONG64)_blocks[index] + 1) << g.big_shift()) + offset;
 
 			// Amount of bytes that can actually be written
-			std::streamsize canwrite = _io->big_block_size() - offset;
+			std::streamsize canwrite = g.big_size() - offset;
 			if (canwrite > data_len )
 				canwrite = data_len;
 
@@ -30,16 +30,23 @@
 // util header
 #pragma once
 
+#include <cstring>
+
 namespace POLE
 {
 
 typedef unsigned char ULONG8;
 typedef unsigned short ULONG16;
-typedef unsigned long  ULONG32;
+typedef unsigned int   ULONG32; // 32 bits on LP64 too, unlike unsigned long
+#if defined(_MSC_VER)
+typedef unsigned __int64 ULONG64;
+#else
+typedef unsigned long long ULONG64;
+#endif
 
 inline ULONG32 readU32( const unsigned char* ptr )
 {
-  return ptr[0]+(ptr[1]<<8)+(ptr[2]<<16)+(ptr[3]<<24);
+  return (ULONG32)ptr[0]+((ULONG32)ptr[1]<<8)+((ULONG32)ptr[2]<<16)+((ULONG32)ptr[3]<<24);
 }
 
 inline void writeU32( unsigned char* ptr, ULONG32 data )
@@ -50,6 +57,17 @@ inline void writeU32( unsigned char* ptr, ULONG32 data )
   ptr[3] = (unsigned char)((data >> 24) & 0xff);
 }
 
+inline ULONG64 readU64( const unsigned char* ptr )
+{
+  return (ULONG64)readU32( ptr ) + ((ULONG64)readU32( ptr + 4 ) << 32);
+}
+
+inline void writeU64( unsigned char* ptr, ULONG64 data )
+{
+  writeU32( ptr, (ULONG32)(data & 0xffffffff) );
+  writeU32( ptr + 4, (ULONG32)(data >> 32) );
+}
+
 inline ULONG16 readU16( const unsigned char* ptr )
 {
   return ptr[0]+(ptr[1]<<8);
@@ -0,0 +1,169 @@
+/* POLE - Portable C++ library to access OLE Storage 
+   Copyright (C) 2005-2006 Jorge Lodos Vigil
+   Copyright (C) 2002-2005 Ariya Hidayat <ariya@kde.org>
+
+   Redistribution and use in source and binary forms, with or without 
+   modification, are permitted provided that the following conditions 
+   are met:
+   * Redistributions of source code must retain the above copyright notice, 
+     this list of conditions and the following disclaimer.
+   * Redistributions in binary form must reproduce the above copyright notice, 
+     this list of conditions and the following disclaimer in the documentation 
+     and/or other materials provided with the distribution.
+   * Neither the name of the authors nor the names of its contributors may be 
+     used to endorse or promote products derived from this software without 
+     specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+   THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// worker thread pool header
+#pragma once
+
+#include <deque>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+namespace POLE
+{
+
+// A fixed set of threads running queued jobs in submission order. An
+// exception thrown by a job is dropped, the job counts as completed and the
+// worker goes on. A job must not call wait(), it would wait for itself.
+template<typename _>
+class WorkPoolT
+{
+public:
+	typedef boost::function<void ()> Job;
+
+// Construction/destruction
+public:
+	// threads is the number of workers, 0 for one per processor.
+	WorkPoolT( unsigned threads = 0 );
+	// Runs the queued jobs then stops the workers.
+	~WorkPoolT();
+
+// Attributes
+public:
+	unsigned threads() const { return _count; }
+	// Jobs queued or running.
+	size_t pending() const;
+
+// Operations
+public:
+	void submit( const Job& job );
+	// Blocks until every submitted job has completed.
+	void wait();
+
+// Implementation
+private:
+	void run();
+
+	std::deque<Job> _jobs;
+	mutable boost::mutex _mutex;
+	boost::condition_variable _ready; // a job was queued or the pool stops
+	boost::condition_variable _idle;  // the last job completed
+	size_t _running;
+	bool _stop;
+	unsigned _count;
+	boost::thread_group _threads;
+
+	// no copy or assign
+	WorkPoolT( const WorkPoolT<_>& );
+	WorkPoolT<_>& operator=( const WorkPoolT<_>& );
+};
+
+typedef WorkPoolT<void> WorkPool;
+
+// =========== WorkPoolT ==========
+
+template<typename _>
+WorkPoolT<_>::WorkPoolT( unsigned threads ): _running(0), _stop(false), _count(threads)
+{
+	if (!_count)
+		_count = boost::thread::hardware_concurrency();
+	if (!_count)
+		_count = 1;
+	for (unsigned i = 0; i < _count; i++)
+		_threads.create_thread( boost::bind( &WorkPoolT<_>::run, this ) );
+}
+
+template<typename _>
+WorkPoolT<_>::~WorkPoolT()
+{
+	{
+		boost::mutex::scoped_lock lock( _mutex );
+		_stop = true;
+	}
+	_ready.notify_all();
+	_threads.join_all();
+}
+
+template<typename _>
+size_t WorkPoolT<_>::pending() const
+{
+	boost::mutex::scoped_lock lock( _mutex );
+	return _jobs.size() + _running;
+}
+
+template<typename _>
+void WorkPoolT<_>::submit( const Job& job )
+{
+	{
+		boost::mutex::scoped_lock lock( _mutex );
+		_jobs.push_back( job );
+	}
+	_ready.notify_one();
+}
+
+template<typename _>
+void WorkPoolT<_>::wait()
+{
+	boost::mutex::scoped_lock lock( _mutex );
+	while (!_jobs.empty() || _running)
+		_idle.wait( lock );
+}
+
+template<typename _>
+void WorkPoolT<_>::run()
+{
+	boost::mutex::scoped_lock lock( _mutex );
+	for (;;)
+	{
+		while (_jobs.empty() && !_stop)
+			_ready.wait( lock );
+		// the queue is drained before stopping
+		if (_jobs.empty())
+			return;
+		Job job = _jobs.front();
+		_jobs.pop_front();
+		_running++;
+		lock.unlock();
+		try
+		{
+			job();
+		}
+		catch (...)
+		{
+			// dropped, the worker must survive and the job still completes
+		}
+		lock.lock();
+		if (--_running == 0 && _jobs.empty())
+			_idle.notify_all();
+	}
+}
+
+} // namespace POLE
@@ -33,6 +33,12 @@
 #pragma once
 
 #include "./detail/stream.hpp"
+#include "./detail/builder.hpp"
+#include "./detail/workpool.hpp"
+#include "./detail/overlay.hpp"
+#include "./detail/snapshot.hpp"
+#include "./detail/metacache.hpp"
+#include "./detail/index.hpp"
 
 namespace POLE
 {
@@ -45,10 +51,22 @@ class StorageT
 public:
   enum { Ok, OpenFailed, OpenSmallFatFailed, NotOLE, BadOLE, UnknownError, StupidWorkaroundForBrokenCompiler=255 };
 
-  // Constructs a storage with name filename.
-  StorageT( const char* filename, std::ios_base::openmode mode = std::ios_base::in, bool create = false )
+  // Constructs a storage with name filename. If directory_only is true only
+  // the header and the directory are read, enough to list the entries, the
+  // rest is read when the first stream is opened. A file opened for reading
+  // that is not larger than slurp_limit is read whole with a single read and
+  // every access is served from memory.
+  StorageT( const char* filename, std::ios_base::openmode mode = std::ios_base::in, bool create = false, bool directory_only = false, ULONG64 slurp_limit = 0 )
   {
-    io = new StorageIO( filename, mode, create );
+    io = new StorageIO( filename, mode, create, directory_only, slurp_limit );
+  }
+
+  // Opens filename for reading through the sidecar index in indexname,
+  // without loading the allocation tables. The document is parsed and the
+  // index written again when it is missing or stale, see SidecarIndex.
+  StorageT( const char* filename, const char* indexname )
+  {
+    io = SidecarIndex::open_or_build( filename, indexname );
   }
 
   // Constructs a storage from a stream.
@@ -57,10 +75,33 @@ public:
     io = new StorageIO( &stream );
   }
 
+  // Constructs a storage read and written through backend, which must remain
+  // valid while the storage is in use.
+  StorageT( Backend& backend, bool directory_only = false )
+  {
+    io = new StorageIO( &backend, false, directory_only );
+  }
+
+  // Constructs a storage that reads the document in place from size bytes
+  // at data, which must remain valid while the storage is in use. Nothing is
+  // copied and streams may return spans of data, see Stream::read_span.
+  StorageT( const void* data, size_t size )
+  {
+    io = new StorageIO( new MemoryBackend( data, size ), true );
+  }
+
+  // Constructs a read only storage on a version pinned from Snapshots. The
+  // version is shared with other threads, so its current directory is always
+  // the root and enterDirectory fails, see Snapshots::pin.
+  StorageT( const Snapshots::Version& pinned ): version(pinned)
+  {
+    io = pinned ? pinned.get() : new StorageIO( (Backend*)NULL, false );
+  }
+
   // Destroys the storage.
   ~StorageT()
   {
-    delete io;
+    if( !version ) delete io;
     std::list<Stream*>::iterator it;
     for( it = streams.begin(); it != streams.end(); ++it )
       delete *it;
@@ -115,16 +156,17 @@ public:
 
 // Operations
 public:
-  // Changes path to directory. Returns true if no error occurs.
+  // Changes path to directory. Returns true if no error occurs. Fails on a
+  // shared version, its current directory is the root.
   bool enterDirectory( const std::string& directory )
   {
-	  	return io->enterDirectory( directory );
+	  	return !version && io->enterDirectory( directory );
   }
 
   // Goes to one directory up.
   void leaveDirectory()
   {
-    io->leaveDirectory();
+    if( !version ) io->leaveDirectory();
   }
 
   // Finds and returns a stream with the specified name.
@@ -142,6 +184,44 @@ public:
     return io->flush();
   }
 
+  // Reads the content of the stream entries in one pass over the document,
+  // in ascending order of position, so the reads never go back. handler
+  // receives the bytes as they are read, with the index of their entry.
+  // Returns false if an entry is not a stream, the document is truncated or
+  // the handler returned false.
+  bool sweep( const std::vector<const DirEntry*>& entries, const SweepHandler& handler );
+
+  // Performs requests[i] on the stream of entries[i], the positions are in
+  // the streams. The parts of all the requests are grouped by the document
+  // block holding them and every block is read once, in document order, so
+  // small streams sharing blocks of the mini stream cost one read per block.
+  // Each request receives its number of bytes read, the total is returned.
+  std::streamsize readv( const std::vector<const DirEntry*>& entries, std::vector<ReadRequest>& requests );
+
+  // The document, for the classes built on top of it such as Overlay.
+  StorageIO* document() const
+  {
+    return io;
+  }
+
+  // Declares in builder a copy of the stream or storage from of this storage
+  // as to, with everything below it. The blocks are copied when the builder
+  // saves, the storage must remain open until then.
+  bool transplant( Builder& builder, const std::string& from, const std::string& to )
+  {
+    return builder.transplant( io, from, to );
+  }
+
+  // Writes a defragmented copy of the storage to filename. Every stream is
+  // stored contiguously, small streams are packed in the mini stream and
+  // blocks not used by any entry are dropped.
+  bool compact( const char* filename )
+  {
+    Builder builder;
+    builder.set_version( io->header()->major() );
+    return builder.add_document( io ) && builder.save( filename );
+  }
+
 #ifndef NDEBUG
   void debug() const
   {
@@ -151,6 +231,7 @@ public:
 
 private:
   StorageIO* io;
+  Snapshots::Version version; // keeps a pinned io alive
   std::list<Stream*> streams;
   
   // no copy or assign
@@ -181,13 +262,13 @@ public: // Attributes
   // Returns the read pointer.
   std::streampos tellg() const
   {
-	  return impl ? impl->tellg() : 0;
+	  return impl ? impl->tellg() : std::streampos(0);
   }
 
   // Returns the write pointer.
   std::streampos tellp() const
   {
-	  return impl ? impl->tellp() : 0;
+	  return impl ? impl->tellp() : std::streampos(0);
   }
 
   // Return the Eof state of the stream
@@ -235,6 +316,45 @@ public: // Operations
     return impl ? impl->read( data, maxlen ) : 0;
   }
 
+  // Reads at pos without moving the read pointer. It may be called from
+  // several threads as long as the document is not being written.
+  std::streamsize read_at( std::streampos pos, unsigned char* data, std::streamsize maxlen ) const
+  {
+    return impl ? impl->read_at( pos, data, maxlen ) : 0;
+  }
+
+  // Many reads at once, sorted and merged by their position in the document.
+  std::streamsize readv( std::vector<ReadRequest>& requests ) const
+  {
+    return impl ? impl->readv( requests ) : 0;
+  }
+
+#if !defined(_WIN32)
+  // Copies len bytes at pos to the file descriptor fd at out_pos, without
+  // moving the read pointer, see StreamImpl::copy_to for buffer. Same thread
+  // safety as read_at.
+  std::streamsize copy_to( int fd, std::streampos pos, std::streamsize len, ULONG64 out_pos, std::vector<unsigned char>* buffer = NULL ) const
+  {
+    return impl ? impl->copy_to( fd, pos, len, out_pos, buffer ) : 0;
+  }
+#endif
+
+  // Returns the data at the read pointer without copying it when the storage
+  // is in memory, len is set to the number of contiguous bytes, up to maxlen.
+  // Returns NULL otherwise, read() must be used then.
+  const unsigned char* read_span( std::streamsize maxlen, std::streamsize& len )
+  {
+    len = 0;
+    return impl ? impl->read_span( maxlen, len ) : NULL;
+  }
+
+  // Like read_span, at any position and without moving the read pointer.
+  const unsigned char* span( std::streampos pos, std::streamsize maxlen, std::streamsize& len ) const
+  {
+    len = 0;
+    return impl ? impl->span( pos, maxlen, len ) : NULL;
+  }
+
   // Write a block of data
   std::streamsize write(const unsigned char* data, std::streamsize len)
   {
@@ -305,6 +425,179 @@ Stream* StorageT<_>::stream( const std::string& name, bool reuse )
   return s;
 }
 
+template<typename _>
+bool StorageT<_>::sweep( const std::vector<const DirEntry*>& entries, const SweepHandler& handler )
+{
+  // reads larger than this are split
+  const ULONG64 window = 1 << 20;
+
+  Backend* backend = io->backend();
+  if (!backend || !handler)
+    return false;
+  std::vector<Extent> extents;
+  for (size_t i = 0; i < entries.size(); ++i)
+  {
+    if (!entries[i] || !entries[i]->file())
+      return false;
+    StreamImpl stream( io, entries[i] );
+    if (!stream.extents( extents, i ))
+      return false;
+  }
+  std::sort( extents.begin(), extents.end() );
+
+  // in memory documents are not copied
+  const unsigned char* base = backend->data();
+  ULONG64 size = backend->size();
+  std::vector<unsigned char> buffer;
+  for (size_t i = 0; i < extents.size(); )
+  {
+    // extents following each other in the document are read at once
+    size_t j = i + 1;
+    ULONG64 length = extents[i].length;
+    for (; j < extents.size() && extents[j].offset == extents[i].offset + length && length + extents[j].length <= window; ++j)
+      length += extents[j].length;
+    if (length > window)
+      length = window;
+    if (extents[i].offset + length > size)
+      return false;
+
+    const unsigned char* data = base ? base + extents[i].offset : NULL;
+    if (!data)
+    {
+      buffer.resize( (size_t)length );
+      if (backend->read_at( extents[i].offset, &buffer[0], (std::streamsize)length ) != (std::streamsize)length)
+        return false;
+      data = &buffer[0];
+    }
+
+    // a single extent larger than the window is delivered in parts
+    if (j == i + 1 && length < extents[i].length)
+    {
+      Extent& e = extents[i];
+      if (!handler( e.stream, e.position, data, (std::streamsize)length ))
+        return false;
+      e.offset += length;
+      e.position += length;
+      e.length -= length;
+      continue;
+    }
+
+    for (; i < j; ++i)
+    {
+      const Extent& e = extents[i];
+      if (!handler( e.stream, e.position, data, (std::streamsize)e.length ))
+        return false;
+      data += e.length;
+    }
+  }
+  return true;
+}
+
+template<typename _>
+std::streamsize StorageT<_>::readv( const std::vector<const DirEntry*>& entries, std::vector<ReadRequest>& requests )
+{
+  // reads of unrelated blocks larger than this are split
+  const ULONG64 window = 1 << 20;
+
+  Backend* backend = io->backend();
+  if (!backend)
+    return 0;
+  std::vector<ReadPiece> pieces;
+  std::vector<Extent> extents;
+  for (size_t i = 0; i < requests.size(); ++i)
+  {
+    ReadRequest& r = requests[i];
+    r.read = 0;
+    if (i >= entries.size() || !entries[i] || !entries[i]->file() || !r.data || r.length <= 0)
+      continue;
+    ULONG64 end = r.offset + r.length;
+    if (end > entries[i]->size())
+      end = entries[i]->size();
+
+    // the parts of the stream inside the request
+    extents.clear();
+    StreamImpl stream( io, entries[i] );
+    stream.extents( extents, i );
+    for (size_t j = 0; j < extents.size(); ++j)
+    {
+      const Extent& e = extents[j];
+      ULONG64 from = (e.position > r.offset) ? e.position : r.offset;
+      ULONG64 to = (e.position + e.length < end) ? e.position + e.length : end;
+      if (from >= to)
+        continue;
+      ReadPiece piece;
+      piece.offset = e.offset + (from - e.position);
+      piece.length = (std::streamsize)(to - from);
+      piece.data = r.data + (from - r.offset);
+      piece.request = i;
+      pieces.push_back( piece );
+    }
+  }
+  std::sort( pieces.begin(), pieces.end() );
+
+  // in memory documents are copied from in place
+  const unsigned char* base = backend->data();
+  ULONG64 size = backend->size();
+  unsigned b_shift = io->header()->b_shift();
+  ULONG64 b_mask = ((ULONG64)1 << b_shift) - 1;
+  std::streamsize total = 0;
+  std::vector<unsigned char> buffer;
+  for (size_t i = 0; i < pieces.size(); )
+  {
+    // the whole blocks holding the pieces, extended while the next piece
+    // starts in the last block or the block after it
+    ULONG64 start = pieces[i].offset & ~b_mask;
+    ULONG64 end = (pieces[i].offset + pieces[i].length + b_mask) & ~b_mask;
+    size_t j = i + 1;
+    for (; j < pieces.size() && (pieces[j].offset & ~b_mask) <= end; ++j)
+    {
+      ULONG64 next = (pieces[j].offset + pieces[j].length + b_mask) & ~b_mask;
+      if (next > end && next - start > window)
+        break;
+      if (next > end)
+        end = next;
+    }
+    if (end > size)
+      end = size;
+
+    const unsigned char* data = NULL;
+    std::streamsize read = 0;
+    if (start < end && end - start > window)
+    {
+      // a single large piece, straight to its destination
+      read = backend->read_at( pieces[i].offset, pieces[i].data, pieces[i].length );
+      requests[pieces[i].request].read += read;
+      total += read;
+      ++i;
+      continue;
+    }
+    if (start < end)
+    {
+      if (base)
+        data = base + start;
+      else
+      {
+        buffer.resize( (size_t)(end - start) );
+        read = backend->read_at( start, &buffer[0], (std::streamsize)(end - start) );
+        data = &buffer[0];
+        end = start + read;
+      }
+    }
+
+    for (; i < j; ++i)
+    {
+      const ReadPiece& p = pieces[i];
+      if (p.offset >= end)
+        continue;
+      std::streamsize count = (p.offset + p.length <= end) ? p.length : (std::streamsize)(end - p.offset);
+      memcpy( p.data, data + (p.offset - start), (size_t)count );
+      requests[p.request].read += count;
+      total += count;
+    }
+  }
+  return total;
+}
+
 }
 
 #endif // POLE_H
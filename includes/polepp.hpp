@@ -29,4 +29,12 @@
 #pragma once
 
 #include "storage.hpp"
+#include "builder.hpp"
+#include "overlay.hpp"
+#include "snapshots.hpp"
+#include "document_cache.hpp"
+#include "reader.hpp"
+#include "streambuf.hpp"
+#include "read_pool.hpp"
+#include "extractor.hpp"
 
@@ -0,0 +1,124 @@
+// POLEPP - Portable C++ library to access OLE Storage 
+// Copyright (C) 2004-2006 Jorge Lodos Vigil
+// Copyright (C) 2004 Israel Fernandez Cabrera
+
+//   Redistribution and use in source and binary forms, with or without 
+//   modification, are permitted provided that the following conditions 
+//   are met:
+//   * Redistributions of source code must retain the above copyright notice, 
+//     this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright notice, 
+//     this list of conditions and the following disclaimer in the documentation 
+//     and/or other materials provided with the distribution.
+//   * Neither the name of the authors nor the names of its contributors may be 
+//     used to endorse or promote products derived from this software without 
+//     specific prior written permission.
+//
+//   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+//   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+//   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+//   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+//   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+//   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+//   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+//   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+//   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+//   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+//   THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+#ifndef _OLE_READ_POOL_
+#define _OLE_READ_POOL_
+
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include "stream.hpp"
+
+namespace ole
+{
+	// The read_pool class performs stream reads on a set of worker threads.
+	// Reads are queued and return at once, the handler is called on a worker
+	// thread when the read completes. The streams and buffers must be valid
+	// until then, and nobody may write to the documents meanwhile.
+	// Handlers may queue more reads but must not call wait() or destroy the
+	// pool, which would deadlock. An exception thrown by a handler is dropped.
+	// The destructor completes every queued read.
+	template<typename _ = void>
+	class basic_read_pool
+	{
+	public:
+		// Receives the number of bytes read.
+		typedef boost::function<void (std::streamsize)> handler;
+		// Receives the whole stream content, empty if nothing could be read.
+		typedef boost::function<void (boost::shared_ptr<std::vector<char> >)> content_handler;
+
+	// Construction/destruction
+	public:
+		// threads is the number of workers, 0 for one per processor.
+		explicit basic_read_pool(unsigned threads = 0): m_pool(threads) {}
+
+	// Attributes
+	public:
+		unsigned threads() const { return m_pool.threads(); }
+		// Reads queued or running.
+		size_t pending() const { return m_pool.pending(); }
+
+	// Operations
+	public:
+		// Reads n bytes at offset of s into buf, like stream::read_at.
+		void read(const stream& s, std::streamoff offset, char* buf, std::streamsize n, const handler& h)
+		{
+			m_pool.submit(boost::bind(&basic_read_pool<_>::do_read, &s, offset, buf, n, h));
+		}
+
+		// Reads the whole stream in a buffer allocated by the pool.
+		void read(const stream& s, const content_handler& h)
+		{
+			m_pool.submit(boost::bind(&basic_read_pool<_>::do_read_content, &s, h));
+		}
+
+		// Performs the requests with stream::readv, the handler receives the
+		// total. Each request receives its number of bytes read.
+		void readv(const stream& s, std::vector<stream::read_request>& requests, const handler& h)
+		{
+			m_pool.submit(boost::bind(&basic_read_pool<_>::do_readv, &s, &requests, h));
+		}
+
+		// Blocks until every queued read has completed.
+		void wait() { m_pool.wait(); }
+
+	// Implementation
+	private:
+		static void do_read(const stream* s, std::streamoff offset, char* buf, std::streamsize n, const handler& h)
+		{
+			std::streamsize read = s->read_at(offset, buf, n);
+			if (h)
+				h(read);
+		}
+		static void do_read_content(const stream* s, const content_handler& h)
+		{
+			boost::shared_ptr<std::vector<char> > content(new std::vector<char>((size_t)s->size()));
+			if (!content->empty())
+				content->resize((size_t)s->read_at(0, &(*content)[0], s->size()));
+			if (h)
+				h(content);
+		}
+		static void do_readv(const stream* s, std::vector<stream::read_request>* requests, const handler& h)
+		{
+			std::streamsize read = s->readv(*requests);
+			if (h)
+				h(read);
+		}
+
+		POLE::WorkPool m_pool;
+
+		basic_read_pool(const basic_read_pool<_>&); // no copy construction
+		basic_read_pool<_>& operator=(const basic_read_pool<_>&); // no assignment operator
+	};
+
+	typedef basic_read_pool<> read_pool;
+}
+
+#endif // _OLE_READ_POOL_
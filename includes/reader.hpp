@@ -0,0 +1,192 @@
+// POLEPP - Portable C++ library to access OLE Storage 
+// Copyright (C) 2004-2006 Jorge Lodos Vigil
+// Copyright (C) 2004 Israel Fernandez Cabrera
+
+//   Redistribution and use in source and binary forms, with or without 
+//   modification, are permitted provided that the following conditions 
+//   are met:
+//   * Redistributions of source code must retain the above copyright notice, 
+//     this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright notice, 
+//     this list of conditions and the following disclaimer in the documentation 
+//     and/or other materials provided with the distribution.
+//   * Neither the name of the authors nor the names of its contributors may be 
+//     used to endorse or promote products derived from this software without 
+//     specific prior written permission.
+//
+//   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+//   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+//   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+//   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+//   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+//   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+//   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+//   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+//   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+//   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+//   THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+#ifndef _OLE_READER_
+#define _OLE_READER_
+
+#include <vector>
+#include "stream.hpp"
+
+namespace ole
+{
+	// The reader class parses binary records from a stream. Data is read in
+	// large buffers with stream::read_at, and when the document is in memory
+	// the reader walks the document itself, so integers are decoded with a
+	// couple of inline instructions. Integers are little endian.
+	// Reading past the end returns 0 and sets the fail state. The read 
+	// position of the stream is not used or changed.
+	// This class is not thread safe, but several readers may share a stream.
+	template<typename _ = void>
+	class basic_reader
+	{
+	public:
+		basic_reader(const stream& s, std::streamsize buffer_size = 65536, std::streamoff pos = 0)
+			: m_stream(s), m_buffer(buffer_size < 64 ? 64 : (size_t)buffer_size), m_base(pos), m_fail(false)
+		{
+			m_begin = m_cur = m_end = (const unsigned char*)&m_buffer[0];
+		}
+
+	// Attributes
+	public:
+		// Position in the stream.
+		std::streamoff tell() const { return m_base + (m_cur - m_begin); }
+		std::streamsize size() const { return m_stream.size(); }
+		bool eof() const { return tell() >= size(); }
+		bool fail() const { return m_fail; }
+
+	// Operations
+	public:
+		POLE::ULONG8 u8() { if (m_cur == m_end && !fill(1)) return failed(); return *m_cur++; }
+		POLE::ULONG16 u16() { if (m_end - m_cur < 2 && !fill(2)) return failed(); POLE::ULONG16 v = POLE::readU16(m_cur); m_cur += 2; return v; }
+		POLE::ULONG32 u32() { if (m_end - m_cur < 4 && !fill(4)) return failed(); POLE::ULONG32 v = POLE::readU32(m_cur); m_cur += 4; return v; }
+		POLE::ULONG64 u64() { if (m_end - m_cur < 8 && !fill(8)) return failed(); POLE::ULONG64 v = POLE::readU64(m_cur); m_cur += 8; return v; }
+
+		// Returns the next byte without consuming it, or -1 at the end.
+		int peek() { return (m_cur == m_end && !fill(1)) ? -1 : *m_cur; }
+
+		// Copies the next n bytes to buf without consuming them. n may not be
+		// larger than the buffer size.
+		bool peek(char* buf, std::streamsize n) { if (m_end - m_cur < n && !fill(n)) return false; memcpy(buf, m_cur, (size_t)n); return true; }
+
+		void skip(std::streamoff n) { if (n >= 0 && n <= m_end - m_cur) m_cur += n; else seek(tell() + n); }
+		void seek(std::streamoff pos);
+
+		// Copies n bytes to buf, large reads go straight from the stream to buf.
+		// Returns the number of bytes copied.
+		std::streamsize read(char* buf, std::streamsize n);
+
+	// Implementation
+	private:
+		bool fill(std::streamsize need);
+		int failed() { m_fail = true; return 0; }
+
+		const stream&              m_stream;
+		std::vector<char>          m_buffer;
+		const unsigned char*       m_begin;  // the buffered data, in m_buffer or in the document
+		const unsigned char*       m_cur;
+		const unsigned char*       m_end;
+		std::streamoff             m_base;   // stream position of m_begin
+		bool                       m_fail;
+
+		basic_reader(const basic_reader&);
+		basic_reader& operator=(const basic_reader&);
+	};
+
+	typedef basic_reader<> reader;
+
+	template<typename _>
+	void basic_reader<_>::seek(std::streamoff pos)
+	{
+		if (pos < 0)
+		{
+			failed();
+			return;
+		}
+		if (pos >= m_base && pos <= m_base + (m_end - m_begin))
+		{
+			m_cur = m_begin + (pos - m_base);
+			return;
+		}
+		m_begin = m_cur = m_end = (const unsigned char*)&m_buffer[0];
+		m_base = pos;
+	}
+
+	// Makes at least need bytes available at m_cur.
+	template<typename _>
+	bool basic_reader<_>::fill(std::streamsize need)
+	{
+		assert(need <= (std::streamsize)m_buffer.size());
+		std::streamoff pos = tell();
+		std::streamsize avail = (std::streamsize)(m_end - m_cur);
+
+		// documents in memory are used in place while the data is contiguous
+		std::streamsize len = 0;
+		const unsigned char* data = (const unsigned char*)m_stream.span(pos, (std::streamsize)m_buffer.size(), len);
+		if (data && len >= need)
+		{
+			m_begin = m_cur = data;
+			m_end = data + len;
+			m_base = pos;
+			return true;
+		}
+
+		unsigned char* buffer = (unsigned char*)&m_buffer[0];
+		if (avail)
+			memmove(buffer, m_cur, (size_t)avail);
+		std::streamsize read = m_stream.read_at(pos + avail, (char*)buffer + avail, (std::streamsize)m_buffer.size() - avail);
+		m_begin = m_cur = buffer;
+		m_end = buffer + avail + (read > 0 ? read : 0);
+		m_base = pos;
+		return m_end - m_cur >= need;
+	}
+
+	template<typename _>
+	std::streamsize basic_reader<_>::read(char* buf, std::streamsize n)
+	{
+		std::streamsize avail = (std::streamsize)(m_end - m_cur);
+		if (n <= avail)
+		{
+			memcpy(buf, m_cur, (size_t)n);
+			m_cur += n;
+			return n;
+		}
+
+		// what is buffered, then the rest
+		memcpy(buf, m_cur, (size_t)avail);
+		m_cur += avail;
+		std::streamsize total = avail;
+		if (n - total >= (std::streamsize)m_buffer.size())
+		{
+			std::streamsize read = m_stream.read_at(tell(), buf + total, n - total);
+			if (read > 0)
+			{
+				seek(tell() + read);
+				total += read;
+			}
+		}
+		else
+		{
+			// the buffer may be a short run of a document in memory
+			while (total < n && fill(1))
+			{
+				std::streamsize count = (std::streamsize)(m_end - m_cur);
+				if (count > n - total)
+					count = n - total;
+				memcpy(buf + total, m_cur, (size_t)count);
+				m_cur += count;
+				total += count;
+			}
+		}
+		if (total < n)
+			m_fail = true;
+		return total;
+	}
+}
+
+#endif // _OLE_READER_
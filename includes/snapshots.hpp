@@ -0,0 +1,81 @@
+// POLEPP - Portable C++ library to access OLE Storage 
+// Copyright (C) 2004-2006 Jorge Lodos Vigil
+// Copyright (C) 2004 Israel Fernandez Cabrera
+
+//   Redistribution and use in source and binary forms, with or without 
+//   modification, are permitted provided that the following conditions 
+//   are met:
+//   * Redistributions of source code must retain the above copyright notice, 
+//     this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright notice, 
+//     this list of conditions and the following disclaimer in the documentation 
+//     and/or other materials provided with the distribution.
+//   * Neither the name of the authors nor the names of its contributors may be 
+//     used to endorse or promote products derived from this software without 
+//     specific prior written permission.
+//
+//   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+//   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+//   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+//   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+//   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+//   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+//   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+//   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+//   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+//   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+//   THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+#ifndef _OLE_SNAPSHOTS_
+#define _OLE_SNAPSHOTS_
+
+#include <boost/shared_ptr.hpp>
+#include "storage.hpp"
+
+namespace ole
+{
+	// The snapshots class lets several threads read a document while one 
+	// thread modifies it. The writer publishes its changes as a new version,
+	// readers pin the last version published and read it through a compound
+	// document. Pinned documents share the version, so their current 
+	// directory is always the root and can not be changed; relative paths 
+	// are relative to the root. The directory of a pinned version never changes, 
+	// so readers are not disturbed by entries written or deleted after the 
+	// pin, and pinning never waits for the writer. Bytes overwritten in place
+	// are seen by every version.
+	// The writer document must remain open until every pinned document is
+	// released.
+	template<typename _ = void>
+	class basic_snapshots
+	{
+	public:
+		typedef boost::shared_ptr<compound_document> document_ptr;
+
+	// Construction/destruction
+	public:
+		// Publishes the current state of writer.
+		basic_snapshots(compound_document& writer): m_snapshots(writer.m_storage ? writer.m_storage->document() : NULL) {}
+
+	// Operations
+	public:
+		// Returns a read only document on the last version published. May be 
+		// called from any thread, the result belongs to the caller.
+		document_ptr pin() const { return document_ptr(new compound_document(m_snapshots.pin())); }
+
+		// Flushes the writer and publishes its state. Must be called from the
+		// writer thread.
+		bool publish() { return m_snapshots.publish(); }
+
+	// Implementation
+	private:
+		POLE::Snapshots m_snapshots;
+
+		basic_snapshots(const basic_snapshots<_>&); // no copy construction
+		basic_snapshots<_>& operator=(const basic_snapshots<_>&); // no assignment operator
+	};
+
+	typedef basic_snapshots<> snapshots;
+}
+
+#endif // _OLE_SNAPSHOTS_
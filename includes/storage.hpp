@@ -35,6 +35,13 @@
 
 namespace ole
 {
+	template<typename _>
+	class basic_document_builder; // Forward declaration
+	template<typename _>
+	class basic_overlay; // Forward declaration
+	template<typename _>
+	class basic_snapshots; // Forward declaration
+
 	// The compound_document class encapsulates an OLE compound document.
 	// This class may iterate all the document's storages. The iterators
 	// iterate the current directory (dir_iterator) or the whole document
@@ -50,9 +57,32 @@ namespace ole
 	class basic_compound_document
 	{
 	public:
+		// Receives the index of the file in the list given to sweep(), the
+		// position in the file, the data and its length. Returns false to abort.
+		typedef POLE::SweepHandler sweep_handler;
+
 		// Construction/destruction
-		basic_compound_document(std::iostream& ios): m_storage(ios) {}
-		basic_compound_document(const std::string& filename, std::ios::openmode mode = std::ios::in, bool create = false);
+		basic_compound_document(std::iostream& ios): m_storage(new POLE::Storage(ios)) {}
+		// Any POLE::Backend, for instance POLE::PosixBackend or POLE::MmapBackend.
+		// The backend must remain valid while the document is in use.
+		basic_compound_document(POLE::Backend& backend, bool directory_only = false): m_storage(new POLE::Storage(backend, directory_only)) {}
+		// A document already in memory, read in place without copying. The
+		// data must remain valid while the document is in use.
+		basic_compound_document(const void* data, size_t size): m_storage(new POLE::Storage(data, size)) {}
+		// A version published by a snapshots object, read only. The version is
+		// shared with other threads, so the current directory stays the root
+		// and enter_directory() fails.
+		basic_compound_document(const POLE::Snapshots::Version& version): m_storage(new POLE::Storage(version)) {}
+		// If directory_only is true opening reads only what listing the entries
+		// needs, the allocation tables are read when the first file is opened.
+		// If they are corrupted good() stays true and opening files fails.
+		// Documents opened for reading up to slurp_limit bytes are read whole 
+		// with a single read, for instance 1 MB for many small documents.
+		basic_compound_document(const std::string& filename, std::ios::openmode mode = std::ios::in, bool create = false, bool directory_only = false, POLE::ULONG64 slurp_limit = 0);
+		// Opens filename for reading through a sidecar index, written in 
+		// indexname when missing or out of date. Opening from the index does 
+		// not depend on the document size.
+		basic_compound_document(const std::string& filename, const std::string& indexname);
 		~basic_compound_document() { if (m_storage) delete m_storage; }
 
 	// Attributes
@@ -76,8 +106,8 @@ namespace ole
 		
 		// Return the file or directory size as stored in the document. Directory 
 		// size should be 0;
-		unsigned long entry_size(const std::string& name) const { const POLE::DirEntry* e = entry_from_string(name); return e ? e->size() : 0; }
-		unsigned long entry_size(const path& p) const { return p.entry_size(); }
+		POLE::ULONG64 entry_size(const std::string& name) const { const POLE::DirEntry* e = entry_from_string(name); return e ? e->size() : 0; }
+		POLE::ULONG64 entry_size(const path& p) const { return p.entry_size(); }
 		
 		// Return the leaf name of the current directory. For instance, if the current
 		// directory is /Macros/VBA returns VBA.
@@ -140,25 +170,45 @@ namespace ole
 
 	// Operations
 	public:
-		// Changes the current directory. Returns true on success.
+		// Changes the current directory. Returns true on success. Always fails
+		// on shared documents, see snapshots and document_cache.
 		bool enter_directory( const std::string& directory ) { assert(m_storage); return m_storage->enterDirectory(directory); }
 		
 		// Makes the parent directory the current directory. If the current directory is 
 		// root it has no effect.
 		void leave_directory() { assert(m_storage); return m_storage->leaveDirectory(); }
 
-		// These are not implemented/tested yet.
+		// These are not implemented/tested yet. New documents are created
+		// with document_builder.
 		bool create_file(const std::string& filename) { assert(m_storage); return m_storage->createFile(filename); }
 		bool create_directory(const std::string& directory) { assert(m_storage); return m_storage->createDirectory(directory); }
 		bool rename(const std::string& path, const std::string& new_name); 
 		bool remove(const std::string& path) { assert(m_storage); return m_storage->delete_entry(path); }
 		bool remove(const path& path) { assert(m_storage); return m_storage->delete_entry(path.name()); }
 
+		// Writes a defragmented copy of the document to filename. Every stream
+		// is stored contiguously and unused space is dropped. 
+		bool compact(const std::string& filename) { assert(m_storage); return m_storage->compact(filename.c_str()); }
+
+		// Reads the content of files in one pass over the document, in the order
+		// the data is stored, and gives it to h as it is read. The parts of a 
+		// file may arrive in any order. Every path must be a file.
+		bool sweep(const std::vector<path>& files, const sweep_handler& h);
+
+		// Performs requests[i] on files[i] like stream::readv, reading every
+		// block of the document once for all the requests. Best to read many
+		// small files, which share the blocks of the mini stream.
+		std::streamsize readv(const std::vector<path>& files, std::vector<stream::read_request>& requests);
+
 	// Implementation
 	private:
 		const POLE::DirEntry* entry_from_string(const std::string& name) const { assert(m_storage); return m_storage->getEntry(name); }
 		POLE::Storage* m_storage;
 
+		friend class basic_document_builder<void>;
+		friend class basic_overlay<void>;
+		friend class basic_snapshots<void>;
+
 		basic_compound_document(); // no default construction
 		basic_compound_document(const basic_compound_document<_>&); // no copy construction
 		basic_compound_document<_>& operator=(const basic_compound_document<_>&); // no assignment operator
@@ -171,11 +221,19 @@ namespace ole
 	////////////////////////////////////////////////////////////////////////////////////////////
 
 	template <typename _>
-	basic_compound_document<_>::basic_compound_document(const std::string& filename, std::ios::openmode mode, bool create): m_storage(NULL) 
+	basic_compound_document<_>::basic_compound_document(const std::string& filename, std::ios::openmode mode, bool create, bool directory_only, POLE::ULONG64 slurp_limit): m_storage(NULL) 
 	{
 		if (filename.empty())
 			return;
-		m_storage = new POLE::Storage(filename.c_str(), mode, create);
+		m_storage = new POLE::Storage(filename.c_str(), mode, create, directory_only, slurp_limit);
+	}
+
+	template <typename _>
+	basic_compound_document<_>::basic_compound_document(const std::string& filename, const std::string& indexname): m_storage(NULL) 
+	{
+		if (filename.empty() || indexname.empty())
+			return;
+		m_storage = new POLE::Storage(filename.c_str(), indexname.c_str());
 	}
 
 	template <typename _>
@@ -208,6 +266,26 @@ namespace ole
 			paths.push_back(path(*it)); // pointers will remain valid as long as the storage
 	}
 
+	template <typename _>
+	bool basic_compound_document<_>::sweep(const std::vector<path>& files, const sweep_handler& h)
+	{
+		assert(m_storage);
+		std::vector<const POLE::DirEntry*> entries(files.size());
+		for (size_t i = 0; i < files.size(); ++i)
+			entries[i] = files[i].m_entry;
+		return m_storage->sweep(entries, h);
+	}
+
+	template <typename _>
+	std::streamsize basic_compound_document<_>::readv(const std::vector<path>& files, std::vector<stream::read_request>& requests)
+	{
+		assert(m_storage);
+		std::vector<const POLE::DirEntry*> entries(files.size());
+		for (size_t i = 0; i < files.size(); ++i)
+			entries[i] = files[i].m_entry;
+		return m_storage->readv(entries, requests);
+	}
+
 	template<class _>
 	typename basic_compound_document<_>::iterator basic_compound_document<_>::find_in_current_directory(const std::string& path) const
 	{
@@ -30,6 +30,9 @@
 #ifndef _OLE_STREAM_
 #define _OLE_STREAM_
 
+#include <boost/iterator/iterator_facade.hpp>
+#include <boost/range/iterator_range.hpp>
+#include <boost/shared_ptr.hpp>
 #include "pole/pole.h"
 
 namespace ole
@@ -43,6 +46,40 @@ namespace ole
 	// This class is not thread safe.
 	class stream
 	{
+	public:
+		// A read only view of a part of the stream.
+		typedef boost::iterator_range<const char*> chunk;
+
+		// Iterates the stream content as chunks. When the document is in memory
+		// (memory or mmap backends) every chunk is a physically contiguous run
+		// of the stream inside the document and nothing is copied. Otherwise 
+		// chunks are read in a buffer owned by the iterator, which is valid 
+		// until the iterator is incremented.
+		class chunk_iterator : public boost::iterator_facade< chunk_iterator, chunk const, boost::single_pass_traversal_tag >
+		{
+		public:
+			chunk_iterator(): m_stream(NULL), m_pos(0), m_end(0) {} // Defaults to end() iterator
+			chunk_iterator(POLE::Stream* stream, std::streamoff pos, std::streamoff end): m_stream(stream), m_pos(pos), m_end(end) { load(); }
+
+		private:
+			friend class boost::iterator_core_access;
+
+			const chunk& dereference() const { assert(m_stream); return m_chunk; }
+			bool equal( const chunk_iterator& rhs ) const { return m_stream == rhs.m_stream && m_pos == rhs.m_pos; }
+			void increment() { assert(m_stream); m_pos += m_chunk.size(); load(); }
+			void load();
+
+			POLE::Stream*                        m_stream;  // NULL at the end
+			std::streamoff                       m_pos;     // position of the current chunk
+			std::streamoff                       m_end;     // past-the-end position
+			chunk                                m_chunk;
+			boost::shared_ptr<std::vector<char> > m_buffer; // used if the document is not in memory
+		};
+		typedef boost::iterator_range<chunk_iterator> chunk_range;
+
+		// A part of a scattered read, see readv.
+		typedef POLE::ReadRequest read_request;
+
 	// Construction
 	public:	
 		stream(POLE::Stream& str): m_stream(str) {}
@@ -62,6 +99,60 @@ namespace ole
 		// These are standard stream operations. This functions may set or 
 		// reset the eof and fail bits.
 		std::streamsize read(char* buf, std::streamsize n) { return m_stream.read((unsigned char *)buf, n); }
+
+		// Reads n bytes at offset. The read position and the eof/fail bits are
+		// not changed, so several threads may read the same stream as long as
+		// nobody writes to the document.
+		std::streamsize read_at(std::streamoff offset, char* buf, std::streamsize n) const { return m_stream.read_at(offset, (unsigned char *)buf, n); }
+
+		// Performs all the requests at once, reading the document in order and
+		// merging the requests stored together. Each request receives the number
+		// of bytes read, the total is returned. Same thread safety as read_at.
+		std::streamsize readv(std::vector<read_request>& requests) const { return m_stream.readv(requests); }
+		
+#if !defined(_WIN32)
+		// Copies n bytes at offset, up to the end of the stream if n is negative,
+		// to the file descriptor fd at out_offset. When the document is read 
+		// with POLE::PosixBackend the kernel copies the data between the files,
+		// with POLE::MmapBackend it is written from the mapping. Otherwise the
+		// data goes through buffer, grown up to n bytes, or through a buffer of
+		// up to 1 MB allocated for the call. Returns the number of bytes copied.
+		// Same thread safety as read_at.
+		std::streamsize copy_to(int fd, std::streamoff offset = 0, std::streamsize n = -1, std::streamoff out_offset = 0, std::vector<unsigned char>* buffer = NULL) const
+		{
+			if (n < 0)
+				n = size() - offset;
+			return m_stream.copy_to(fd, offset, n, out_offset, buffer);
+		}
+
+		// Writes the whole stream to filename, which is replaced if it exists.
+		bool copy_to(const std::string& filename) const
+		{
+			int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+			if (fd < 0)
+				return false;
+			bool ok = copy_to(fd) == size();
+			return (::close(fd) == 0) && ok;
+		}
+#endif
+
+		// Returns up to n bytes at the read position without copying them if
+		// the document is in memory, len receives the number of bytes. Returns
+		// NULL if the document is not in memory.
+		const char* read_span(std::streamsize n, std::streamsize& len) { return (const char*)m_stream.read_span(n, len); }
+
+		// Like read_span at offset, the read position is not changed.
+		const char* span(std::streamoff offset, std::streamsize n, std::streamsize& len) const { return (const char*)m_stream.span(offset, n, len); }
+
+		// Returns the chunks of n bytes starting at pos, up to the end of the
+		// stream if n is negative. The read position is not changed.
+		chunk_range chunks(std::streamoff pos = 0, std::streamsize n = -1)
+		{
+			std::streamoff end = size();
+			if (n >= 0 && pos + n < end)
+				end = pos + n;
+			return chunk_range(chunk_iterator(&m_stream, pos, end), chunk_iterator());
+		}
 		std::streamsize write(const char* buf, std::streamsize n) { return m_stream.write((unsigned char *)buf, n); }
 		std::streampos seek(std::streamoff off, std::ios::seekdir way, std::ios::openmode mode) { return m_stream.seek(off, way, mode); }
 		void seekg(std::streamoff off, std::ios::seekdir way) { m_stream.seekg(off, way); }
@@ -84,6 +175,36 @@ namespace ole
 		stream(); // No default construction
 		stream& operator=( const stream& other ); // No asignment operator 
 	};
+
+	inline void stream::chunk_iterator::load()
+	{
+		if (m_pos >= m_end)
+		{
+			// become the end iterator
+			m_stream = NULL;
+			m_pos = 0;
+			return;
+		}
+
+		std::streamsize len = 0;
+		const char* data = (const char*)m_stream->span(m_pos, m_end - m_pos, len);
+		if (!data)
+		{
+			// not in memory, read the next part without moving the read position
+			if (!m_buffer)
+				m_buffer.reset(new std::vector<char>(65536));
+			len = (m_end - m_pos < (std::streamoff)m_buffer->size()) ? (std::streamsize)(m_end - m_pos) : (std::streamsize)m_buffer->size();
+			len = m_stream->read_at(m_pos, (unsigned char*)&(*m_buffer)[0], len);
+			data = &(*m_buffer)[0];
+		}
+		if (len <= 0)
+		{
+			m_stream = NULL;
+			m_pos = 0;
+			return;
+		}
+		m_chunk = chunk(data, data + len);
+	}
 }
 
 #endif // _OLE_STREAM_
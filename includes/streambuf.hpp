@@ -0,0 +1,210 @@
+// POLEPP - Portable C++ library to access OLE Storage 
+// Copyright (C) 2004-2006 Jorge Lodos Vigil
+// Copyright (C) 2004 Israel Fernandez Cabrera
+
+//   Redistribution and use in source and binary forms, with or without 
+//   modification, are permitted provided that the following conditions 
+//   are met:
+//   * Redistributions of source code must retain the above copyright notice, 
+//     this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright notice, 
+//     this list of conditions and the following disclaimer in the documentation 
+//     and/or other materials provided with the distribution.
+//   * Neither the name of the authors nor the names of its contributors may be 
+//     used to endorse or promote products derived from this software without 
+//     specific prior written permission.
+//
+//   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+//   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+//   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+//   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+//   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+//   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+//   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+//   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+//   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+//   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+//   THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+#ifndef _OLE_STREAMBUF_
+#define _OLE_STREAMBUF_
+
+#include <cstring>
+#include <streambuf>
+#include <vector>
+#include "stream.hpp"
+
+namespace ole
+{
+	// The streambuf class adapts a stream to the standard iostreams, for 
+	// instance std::istream is(&buf) or os << &buf. The buffer may be supplied
+	// by the caller, otherwise size bytes are allocated. Requests larger than 
+	// the buffer are transferred directly between the caller and the document.
+	// Like std::filebuf there is a single position for reading and writing,
+	// writes never grow the stream. Reads go through the stream read pointer
+	// so sequential reads are prefetched.
+	// This class is not thread safe.
+	class streambuf : public std::streambuf
+	{
+	// Construction/destruction
+	public:
+		streambuf(stream& s, char* buffer = NULL, std::streamsize size = 65536)
+			: m_stream(s), m_buffer(buffer), m_size(size < 1 ? 1 : size), m_base(0), m_writing(false)
+		{
+			if (!m_buffer)
+			{
+				m_own.resize((size_t)m_size);
+				m_buffer = &m_own[0];
+			}
+			setg(m_buffer, m_buffer, m_buffer);
+		}
+		~streambuf() { sync(); }
+
+	// Implementation
+	protected:
+		int_type underflow()
+		{
+			if (!leave_put())
+				return traits_type::eof();
+			m_base = position();
+			m_stream.seekg(m_base, std::ios::beg);
+			std::streamsize read = m_stream.read(m_buffer, m_size);
+			setg(m_buffer, m_buffer, m_buffer + (read > 0 ? read : 0));
+			return (read > 0) ? traits_type::to_int_type(*gptr()) : traits_type::eof();
+		}
+
+		std::streamsize xsgetn(char* s, std::streamsize n)
+		{
+			if (!leave_put())
+				return 0;
+			std::streamsize total = egptr() - gptr();
+			if (total >= n || n - total < m_size)
+				return std::streambuf::xsgetn(s, n);
+
+			// large read, what is buffered then straight to the caller
+			memcpy(s, gptr(), (size_t)total);
+			std::streamoff pos = position() + total;
+			m_stream.seekg(pos, std::ios::beg);
+			std::streamsize read = m_stream.read(s + total, n - total);
+			if (read > 0)
+				total += read;
+			m_base = pos + (read > 0 ? read : 0);
+			setg(m_buffer, m_buffer, m_buffer);
+			return total;
+		}
+
+		std::streamsize showmanyc()
+		{
+			std::streamoff left = m_stream.size() - position();
+			return (left > 0) ? (std::streamsize)left : -1;
+		}
+
+		int_type overflow(int_type c)
+		{
+			if (!enter_put() || (pptr() == epptr() && !flush_put()))
+				return traits_type::eof();
+			if (traits_type::eq_int_type(c, traits_type::eof()))
+				return traits_type::not_eof(c);
+			*pptr() = traits_type::to_char_type(c);
+			pbump(1);
+			return c;
+		}
+
+		std::streamsize xsputn(const char* s, std::streamsize n)
+		{
+			if (n < m_size)
+				return std::streambuf::xsputn(s, n);
+
+			// large write, straight to the document
+			if (!enter_put() || !flush_put())
+				return 0;
+			m_stream.seekp(m_base, std::ios::beg);
+			std::streamsize written = m_stream.write(s, n);
+			m_base += written;
+			return written;
+		}
+
+		pos_type seekoff(off_type off, std::ios::seekdir way, std::ios::openmode /*which*/ = std::ios::in | std::ios::out)
+		{
+			if (!leave_put())
+				return pos_type(off_type(-1));
+			std::streamoff target = off;
+			if (way == std::ios::cur)
+				target += position();
+			else if (way == std::ios::end)
+				target += m_stream.size();
+			if (target < 0 || target > m_stream.size())
+				return pos_type(off_type(-1));
+
+			// stay in the buffer if possible
+			if (target >= m_base && target <= m_base + (egptr() - eback()))
+				setg(eback(), eback() + (target - m_base), egptr());
+			else
+			{
+				m_base = target;
+				setg(m_buffer, m_buffer, m_buffer);
+			}
+			return pos_type(target);
+		}
+
+		pos_type seekpos(pos_type pos, std::ios::openmode which = std::ios::in | std::ios::out)
+		{
+			return seekoff(off_type(pos), std::ios::beg, which);
+		}
+
+		int sync() { return (!m_writing || flush_put()) ? 0 : -1; }
+
+	private:
+		// Position of the next character read or written.
+		std::streamoff position() const { return m_base + (m_writing ? pptr() - pbase() : gptr() - eback()); }
+
+		// Switches between reading and writing, the buffer is used by one of them.
+		bool enter_put()
+		{
+			if (m_writing)
+				return true;
+			m_base = position();
+			setg(m_buffer, m_buffer, m_buffer);
+			setp(m_buffer, m_buffer + m_size);
+			m_writing = true;
+			return true;
+		}
+		bool leave_put()
+		{
+			if (!m_writing)
+				return true;
+			if (!flush_put())
+				return false;
+			setp(NULL, NULL);
+			setg(m_buffer, m_buffer, m_buffer);
+			m_writing = false;
+			return true;
+		}
+
+		// Writes the put area, m_base is its position.
+		bool flush_put()
+		{
+			std::streamsize n = pptr() - pbase();
+			if (n == 0)
+				return true;
+			m_stream.seekp(m_base, std::ios::beg);
+			std::streamsize written = m_stream.write(pbase(), n);
+			m_base += written;
+			setp(m_buffer, m_buffer + m_size);
+			return written == n;
+		}
+
+		stream&            m_stream;
+		std::vector<char>  m_own;     // the buffer if not supplied
+		char*              m_buffer;
+		std::streamsize    m_size;
+		std::streamoff     m_base;    // stream position of the buffer
+		bool               m_writing; // the buffer is the put area
+
+		streambuf(const streambuf&);
+		streambuf& operator=(const streambuf&);
+	};
+}
+
+#endif // _OLE_STREAMBUF_
@@ -2,6 +2,8 @@
 // Copyright (C) 2004-2006 Jorge Lodos Vigil
 // Copyright (C) 2004 Israel Fernandez Cabrera
 
+#include <sstream>
+
 #include <boost/filesystem/path.hpp>
 #include <boost/filesystem/exception.hpp>
 #include <boost/filesystem/operations.hpp>
@@ -102,16 +104,13 @@ bool extract(ole::compound_document& doc, const boost::filesystem::path& folder)
 				filename.erase(0, 1);
 			new_path /= filename;
 			std::cout << "Saving file: " << new_path.string().c_str() << std::endl;
-			std::streamsize size = s->size();
-			// In a real world program this would be a fixed size buffer used within a
-			// read/write loop. Checking on read result is also needed.
-			char* buf = new char[size];
-			s->read(buf, size);
 			std::ofstream os(new_path.string().c_str(), std::ios::binary);
 			if (os.fail())
 				return false;
-			os.write(buf, size);
-			delete[] buf;
+			// The stream is copied through a fixed size buffer
+			ole::streambuf sb(*s);
+			if (s->size() > 0 && !(os << &sb))
+				return false;
 		}
 	}
 
@@ -124,17 +123,290 @@ int die(const std::string& msg)
 	exit(-1);
 }
 
+// Self checks, they write their documents in the destination folder and
+// stop the program on the first failure.
+
+void check(bool condition, const std::string& msg)
+{
+	if (!condition)
+		die("Check failed: " + msg);
+}
+
+// The content of the test streams, every byte depends on its position and
+// on the stream.
+unsigned char pattern(POLE::ULONG64 pos, unsigned seed)
+{
+	return (unsigned char)(pos ^ (pos >> 9) ^ (pos >> 29) ^ (seed * 0x5b));
+}
+
+struct pattern_source
+{
+	pattern_source(unsigned seed): m_seed(seed), m_pos(0) {}
+	std::streamsize operator()(unsigned char* buffer, std::streamsize len)
+	{
+		// the high bits of the pattern change every 512 bytes
+		for (std::streamsize i = 0; i < len; )
+		{
+			unsigned char high = pattern(m_pos, m_seed) ^ (unsigned char)m_pos;
+			std::streamsize end = std::min<std::streamsize>(len, i + 512 - (std::streamsize)(m_pos % 512));
+			unsigned char low = (unsigned char)m_pos;
+			m_pos += end - i;
+			for (; i < end; ++i)
+				buffer[i] = high ^ low++;
+		}
+		return len;
+	}
+	unsigned m_seed;
+	POLE::ULONG64 m_pos;
+};
+
+// An entry expected in a document, streams have a seed for their content.
+struct expected_entry
+{
+	expected_entry(const std::string& n, bool d, POLE::ULONG64 s = 0, unsigned sd = 0): name(n), dir(d), size(s), seed(sd) {}
+	std::string name;
+	bool dir;
+	POLE::ULONG64 size;
+	unsigned seed;
+};
+
+// Compares the entries of filename, their names, sizes and content, with
+// the expected ones.
+void check_document(const std::string& filename, const std::vector<expected_entry>& expected)
+{
+	POLE::StorageIO io(filename.c_str(), std::ios::in, false);
+	check(io.result() == POLE::StorageIO::Ok, "open " + filename);
+	std::vector<const POLE::DirEntry*> entries;
+	io.listAll(entries);
+	size_t count = 0;
+	for (size_t i = 0; i < entries.size(); ++i)
+		if (!entries[i]->root())
+			++count;
+	check(count == expected.size(), "entry count of " + filename);
+
+	for (size_t i = 0; i < expected.size(); ++i)
+	{
+		const expected_entry& x = expected[i];
+		const POLE::DirEntry* e = io.entry(x.name);
+		check(e && e->dir() == x.dir, "entry " + x.name);
+		std::string name;
+		io.fullName(e, name);
+		check(name == x.name, "name of " + x.name);
+		if (x.dir)
+			continue;
+		check(e->size() == x.size, "size of " + x.name);
+		POLE::StreamImpl s(&io, e);
+		std::vector<unsigned char> data((size_t)x.size + 1);
+		check(s.read_at(0, &data[0], (std::streamsize)data.size()) == (std::streamsize)x.size, "read " + x.name);
+		for (size_t j = 0; j < x.size; ++j)
+			check(data[j] == pattern(j, x.seed), "content of " + x.name);
+	}
+}
+
+// Builds a document with nested storages, streams below and above the mini
+// stream threshold and an empty one, then reads it back.
+void check_builder(const boost::filesystem::path& folder, unsigned major)
+{
+	std::vector<expected_entry> expected;
+	expected.push_back(expected_entry("/Small", false, 100, 1));
+	expected.push_back(expected_entry("/Big", false, 10000, 2));
+	expected.push_back(expected_entry("/Empty", false, 0, 0));
+	expected.push_back(expected_entry("/Storage", true));
+	expected.push_back(expected_entry("/Storage/Nested", true));
+	expected.push_back(expected_entry("/Storage/Nested/Under", false, 4095, 3));
+	expected.push_back(expected_entry("/Storage/Nested/Over", false, 4096, 4));
+	expected.push_back(expected_entry("/Storage/Empty Storage", true));
+
+	POLE::Builder builder;
+	builder.set_version(major);
+	for (size_t i = 0; i < expected.size(); ++i)
+	{
+		const expected_entry& x = expected[i];
+		bool res = x.dir ? builder.add_directory(x.name) : builder.add_stream(x.name, x.size, pattern_source(x.seed));
+		check(res, "add " + x.name);
+	}
+
+	// rejected entries change nothing
+	size_t count = builder.entryCount();
+	check(!builder.add_stream("/Rejected/A name longer than 31 characters", 10, pattern_source(5)), "reject a long name");
+	check(!builder.add_directory("/Storage/Nested/Under/Below"), "reject a storage below a stream");
+	check(!builder.add_stream("/Small", 10, pattern_source(5)), "reject a stream declared twice");
+	check(builder.entryCount() == count && builder.result() == POLE::Builder::BadPath, "rejected entries");
+
+	std::string filename = (folder / (major >= 4 ? "builder4.cfb" : "builder3.cfb")).string();
+	std::streamoff size = builder.plan().size();
+	check(builder.save(filename.c_str()), "save " + filename);
+	check((std::streamoff)boost::filesystem::file_size(filename) == size, "planned size of " + filename);
+
+	POLE::StorageIO io(filename.c_str(), std::ios::in, false);
+	check(io.header()->major() == major, "version of " + filename);
+	check_document(filename, expected);
+}
+
+// Deletes entries of a document in place, which leaves their blocks
+// allocated, then compacts it. The copy must hold the same entries with the
+// same content and be smaller.
+void check_compact(const boost::filesystem::path& folder)
+{
+	std::vector<expected_entry> all;
+	all.push_back(expected_entry("/Kept", true));
+	all.push_back(expected_entry("/Deleted", true));
+	for (unsigned i = 0; i < 24; ++i)
+	{
+		std::ostringstream name;
+		name << ((i % 3) ? "/Kept/" : "/Deleted/") << "Stream" << i;
+		all.push_back(expected_entry(name.str(), false, 700 * (i + 1), i + 1));
+	}
+	POLE::Builder builder;
+	builder.set_version(3);
+	for (size_t i = 0; i < all.size(); ++i)
+		check(all[i].dir ? builder.add_directory(all[i].name) : builder.add_stream(all[i].name, all[i].size, pattern_source(all[i].seed)), "add " + all[i].name);
+	std::string filename = (folder / "edited.cfb").string();
+	check(builder.save(filename.c_str()), "save " + filename);
+
+	std::vector<expected_entry> kept;
+	std::string compacted = (folder / "compacted.cfb").string();
+	{
+		POLE::Storage storage(filename.c_str(), std::ios::in | std::ios::out);
+		check(storage.result() == POLE::Storage::Ok, "open " + filename);
+		for (size_t i = 0; i < all.size(); ++i)
+			if (all[i].name.compare(0, 8, "/Deleted") != 0)
+				kept.push_back(all[i]);
+			else if (!all[i].dir)
+				check(storage.delete_entry(all[i].name), "delete " + all[i].name);
+		check(storage.delete_entry("/Deleted"), "delete /Deleted");
+		check(storage.flush(), "flush " + filename);
+		check(storage.compact(compacted.c_str()), "compact " + filename);
+	}
+	check_document(filename, kept);
+	check_document(compacted, kept);
+	check(boost::filesystem::file_size(compacted) < boost::filesystem::file_size(filename), "size of " + compacted);
+}
+
+// A version 4 document too large to be written in the check. The blocks
+// before the streams are kept in memory, the streams are generated on
+// demand from their pattern.
+class large_document : public POLE::Backend
+{
+public:
+	large_document(POLE::ULONG64 data_offset, POLE::ULONG64 size, unsigned seed): m_data_offset(data_offset), m_size(size), m_seed(seed), m_written(0), m_ok(true) {}
+
+	// Receives the document from the builder, only the first byte of every
+	// write to the streams is checked.
+	bool put(const unsigned char* data, std::streamsize len)
+	{
+		for (std::streamsize i = 0; i < len && m_written + i < m_data_offset; ++i)
+			m_meta.push_back(data[i]);
+		if (m_written >= m_data_offset)
+			m_ok = m_ok && data[0] == pattern(m_written - m_data_offset, m_seed);
+		m_written += len;
+		return true;
+	}
+	POLE::ULONG64 written() const { return m_written; }
+	bool ok() const { return m_ok; }
+
+	bool good() const { return true; }
+	POLE::ULONG64 size() { return m_size; }
+	std::streamsize read_at(POLE::ULONG64 pos, unsigned char* data, std::streamsize len)
+	{
+		std::streamsize count = 0;
+		for (; count < len && pos < m_size; ++count, ++pos)
+			data[count] = (pos < m_data_offset) ? m_meta[(size_t)pos] : pattern(pos - m_data_offset, m_seed);
+		return count;
+	}
+	std::streamsize write_at(POLE::ULONG64, const unsigned char*, std::streamsize) { return 0; }
+
+private:
+	POLE::ULONG64 m_data_offset;
+	POLE::ULONG64 m_size;
+	unsigned m_seed;
+	std::vector<unsigned char> m_meta;
+	POLE::ULONG64 m_written;
+	bool m_ok;
+};
+
+struct large_sink
+{
+	large_sink(large_document& doc): m_doc(&doc) {}
+	bool operator()(const unsigned char* data, std::streamsize len) { return m_doc->put(data, len); }
+	large_document* m_doc;
+};
+
+// Builds a version 4 document holding a stream larger than 4GB, whose
+// allocation table needs a DIFAT chain, and reads it back around the 4GB
+// boundary and at the end.
+void check_large()
+{
+	const POLE::ULONG64 size = ((POLE::ULONG64)4 << 30) + 4097;
+	POLE::Builder builder;
+	builder.set_version(4);
+	check(builder.add_stream("/Storage/Small", 100, pattern_source(1)), "add /Storage/Small");
+	check(builder.add_stream("/Large", size, pattern_source(2)), "add /Large");
+	const POLE::BuilderLayout& layout = builder.plan();
+	check(layout.b_shift == 12 && layout.num_mbat > 0, "layout of the large document");
+
+	large_document doc(((POLE::ULONG64)layout.data_start + 1) << layout.b_shift, layout.size(), 2);
+	check(builder.save(large_sink(doc)), "save the large document");
+	check(doc.ok() && doc.written() == (POLE::ULONG64)layout.size(), "content of the large document");
+
+	POLE::StorageIO io(&doc, false);
+	check(io.result() == POLE::StorageIO::Ok, "open the large document");
+	check(io.header()->major() == 4 && io.big_block_size() == 4096 && io.header()->num_mbat() == layout.num_mbat, "header of the large document");
+	const POLE::DirEntry* small = io.entry("/Storage/Small");
+	check(small && small->size() == 100, "entry /Storage/Small");
+	unsigned char data[2000];
+	POLE::StreamImpl s(&io, small);
+	check(s.read_at(0, data, sizeof(data)) == 100, "read /Storage/Small");
+	for (size_t i = 0; i < 100; ++i)
+		check(data[i] == pattern(i, 1), "content of /Storage/Small");
+
+	const POLE::DirEntry* large = io.entry("/Large");
+	check(large && large->size() == size, "size of /Large");
+	POLE::StreamImpl l(&io, large);
+	const POLE::ULONG64 positions[] = { 0, ((POLE::ULONG64)1 << 32) - 1000, size - 1000 };
+	for (size_t k = 0; k < sizeof(positions) / sizeof(positions[0]); ++k)
+	{
+		POLE::ULONG64 pos = positions[k];
+		std::streamsize expected = (std::streamsize)std::min<POLE::ULONG64>(sizeof(data), size - pos);
+		check(l.read_at((std::streampos)pos, data, sizeof(data)) == expected, "read /Large");
+		for (std::streamsize i = 0; i < expected; ++i)
+			check(data[i] == pattern(pos + i, 2), "content of /Large");
+	}
+}
+
+void self_check(const boost::filesystem::path& folder)
+{
+	check_builder(folder, 3);
+	check_builder(folder, 4);
+	check_compact(folder);
+	check_large();
+	std::cout << "Self checks passed." << std::endl;
+}
+
 
 int main(int argc, char* argv[])
 {
-	// A file name and destination directory must be supplied
-	if (argc != 3)
+	// A destination directory must be supplied, the file name is optional
+	if (argc != 2 && argc != 3)
 	{
-		die("Usage: pole_pp_test <file_name> <folder_name>");
+		die("Usage: pole_pp_test [<file_name>] <folder_name>");
 	}
 
 	try // catch filesystem errors
 	{
+		// Create destination folder if needed
+		boost::filesystem::path folder(argv[argc-1], boost::filesystem::native);
+		if (!boost::filesystem::exists(folder))
+			boost::filesystem::create_directory(folder);
+
+		// Check the library on documents it writes itself
+		self_check(folder);
+		if (argc == 2)
+		{
+			std::cout << "Done." << std::endl;
+			return 0;
+		}
+
 		// Verify input file
 		boost::filesystem::path file(argv[1], boost::filesystem::native);
 		if (!boost::filesystem::exists(file))
@@ -183,11 +455,6 @@ int main(int argc, char* argv[])
 		for (path_it = cur_path.begin(doc); path_it != cur_path.end(); ++path_it)
 			std::cout << "Path element: " << path_it->c_str() << std::endl;
 		std::cout << std::endl;
-		
-		// Create destination folder if needed
-		boost::filesystem::path folder(argv[2], boost::filesystem::native);
-		if (!boost::filesystem::exists(folder))
-			boost::filesystem::create_directory(folder);
 
 		// Extract all streams and save to disk
 		res = extract(doc, folder);